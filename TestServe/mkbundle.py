@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+# Makes an asset bundle (see bundle.h) out of a directory of files, so a
+# configuration can be fetched in one request.
+#
+#   mkbundle.py files [bundle.cvmb]
+#
+# Every file in the directory goes in, other than the bundle itself and
+# index.json, under its path relative to the directory (which is how the
+# server names it).
+
+import email.utils
+import json
+import os
+import sys
+
+MAGIC = b"CVMBUNDLE 1\n"
+
+def fnv1a(data):
+    # Must match Cache::hashBytes()
+    value = 0xcbf29ce484222325
+    for byte in bytearray(data):
+        value ^= byte
+        value = (value * 0x100000001b3) & 0xffffffffffffffff
+    return "%016x" % value
+
+def collect(directory, bundleName):
+    files = []
+    for root, dirs, names in os.walk(directory):
+        dirs.sort()
+        for name in sorted(names):
+            fullPath = os.path.join(root, name)
+            path = "/" + os.path.relpath(fullPath, directory)
+            path = path.replace(os.sep, "/")
+            # index.json is left out, as the screensaver would otherwise
+            # take it as fresh and never see a new configuration
+            if path == bundleName or name.endswith(".cvmb") or \
+               path == "/index.json":
+                continue
+            files.append((path, fullPath))
+    return files
+
+def makeBundle(directory, bundleName):
+    contents = []
+    body = []
+    offset = 0
+    for path, fullPath in collect(directory, bundleName):
+        with open(fullPath, "rb") as source:
+            data = source.read()
+        # Validators as mockserver sends them for the file
+        hash = fnv1a(data)
+        modified = email.utils.formatdate(os.path.getmtime(fullPath),
+                                          usegmt=True)
+        contents.append({"path": path, "hash": hash,
+                         "offset": offset, "length": len(data),
+                         "etag": '"%s"' % hash,
+                         "lastModified": modified})
+        body.append(data)
+        offset += len(data)
+
+    table = json.dumps(contents).encode("utf-8")
+    with open(os.path.join(directory, bundleName.lstrip("/")), "wb") as out:
+        out.write(MAGIC)
+        out.write(("%d\n" % len(table)).encode("ascii"))
+        out.write(table)
+        for data in body:
+            out.write(data)
+
+    return contents
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit("usage: mkbundle.py directory [bundle name]")
+
+    bundleName = "/bundle.cvmb"
+    if len(sys.argv) > 2:
+        bundleName = "/" + sys.argv[2].lstrip("/")
+
+    contents = makeBundle(sys.argv[1], bundleName)
+    print("%s: %d files, %d bytes" % (bundleName, len(contents),
+          sum(entry["length"] for entry in contents)))
@@ -0,0 +1,37 @@
+#!/usr/bin/env python
+# Makes an asset manifest (see manifest.h) for a directory of files, so the
+# screensaver only fetches the files that have changed.
+#
+#   mkmanifest.py files [manifest.json]
+#
+# Every file in the directory is listed, other than bundles, index.json
+# and the manifest itself, under its path relative to the directory.
+
+import json
+import os
+import sys
+
+from mkbundle import collect, fnv1a
+
+def makeManifest(directory, manifestName):
+    manifest = {}
+    for path, fullPath in collect(directory, manifestName):
+        with open(fullPath, "rb") as source:
+            manifest[path] = fnv1a(source.read())
+
+    output = os.path.join(directory, manifestName.lstrip("/"))
+    with open(output, "w") as out:
+        json.dump(manifest, out, indent=2, sort_keys=True)
+
+    return manifest
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit("usage: mkmanifest.py directory [manifest name]")
+
+    manifestName = "/manifest.json"
+    if len(sys.argv) > 2:
+        manifestName = "/" + sys.argv[2].lstrip("/")
+
+    manifest = makeManifest(sys.argv[1], manifestName)
+    print("%s: %d files" % (manifestName, len(manifest)))
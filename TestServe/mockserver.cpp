@@ -0,0 +1,562 @@
+////////////////////////////////////////////////////////////////////////////
+// mockserver - a stand in for the VM's web server
+//
+// Serves a directory (TestServe/files by default) over HTTP/1.1 on port
+// 7859, where the screensaver looks for the VM, and can make the link as
+// bad as needed:
+//
+//   --dir=PATH          Directory to serve
+//   --port=N            Port to listen on
+//   --latency=MS        Delay before every response
+//   --bandwidth=BYTES   Cap on bytes per second, per connection
+//   --slowstart=BYTES   Start each connection sending this much per round
+//                       trip (the latency), doubling until the cap
+//   --fail=FRACTION     Fraction of requests whose connection is dropped
+//                       without an answer
+//   --cut=FRACTION      Fraction of bodies whose connection is dropped
+//                       half way through, for resuming downloads
+//   --conditional=MODE  "honour" answers conditional requests with 304s
+//                       (the default), "ignore" always sends the file
+//   --watch=PATH        Path of the change notification long poll
+//                       (/watch by default)
+//   --hold=SECONDS      How long a long poll is held before a 304
+//
+// Open ended ranges ("Range: bytes=N-", as libcurl sends to resume) are
+// served, subject to If-Range. A request for the watch path whose
+// If-None-Match is the current state of the directory is held until a
+// file changes (answered 200 with the new state as its ETag) or the hold
+// runs out (304), as settings.watch expects. It is deliberately simple
+// otherwise - one thread per connection, GET and HEAD only. Build it with
+// "make mockserver".
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <map>
+#include <set>
+#include <sstream>
+#include <iostream>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using std::string;
+using std::map;
+using std::stringstream;
+using std::cerr;
+using std::endl;
+
+namespace Mock
+{
+  struct Options
+  {
+    string directory;
+    int    port;
+    double latency;        // Seconds
+    double bandwidth;      // Bytes per second, 0 for no cap
+    double slowStart;      // Bytes in the first round trip, 0 for none
+    double failRate;
+    double cutRate;
+    bool   honourConditional;
+    string watchPath;
+    double holdTime;       // Seconds
+  };
+
+  struct Request
+  {
+    string method;
+    string path;
+    map<string, string> headers;
+  };
+
+  struct Connection
+  {
+    int     socket;
+    double  roundSize;     // Slow start - bytes per round trip, 0 once over
+    double  window;        // What's left of this round trip
+  };
+};
+
+Mock::Options options;
+pthread_mutex_t randomLock = PTHREAD_MUTEX_INITIALIZER;
+
+void sleepFor( double seconds )
+{
+  if ( seconds > 0 )
+    usleep( (useconds_t)( seconds * 1e6 ) );
+}
+
+bool chance( double fraction )
+{
+  pthread_mutex_lock( &randomLock );
+  double roll = rand() / ( RAND_MAX + 1.0 );
+  pthread_mutex_unlock( &randomLock );
+  return roll < fraction;
+}
+
+string lowerCase( string text )
+{
+  for ( size_t i = 0; i < text.size(); i++ )
+    text[i] = tolower( text[i] );
+  return text;
+}
+
+string trim( const string& text )
+{
+  size_t start = text.find_first_not_of( " \t\r\n" );
+  size_t end   = text.find_last_not_of( " \t\r\n" );
+  if ( start == string::npos )
+    return "";
+  return text.substr( start, end - start + 1 );
+}
+
+string hashContent( const string& data )
+{
+  // Same as Cache::hashBytes(), so ETags match the client's content hash
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for ( size_t i = 0; i < data.size(); i++ )
+  {
+    hash ^= (unsigned char) data[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  char hex[17];
+  snprintf( hex, sizeof(hex), "%016llx", (unsigned long long) hash );
+  return hex;
+}
+
+string httpDate( time_t when )
+{
+  char date[64];
+  strftime( date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+            gmtime( &when ) );
+  return date;
+}
+
+bool readRequest( int socket, string& pending, Mock::Request& request )
+{
+  // Reads up to the blank line ending the headers. Bodies are never sent
+  // with GET or HEAD, so anything after that is the next request.
+  size_t headerEnd;
+  while ( ( headerEnd = pending.find( "\r\n\r\n" ) ) == string::npos )
+  {
+    char buffer[ 4096 ];
+    ssize_t got = recv( socket, buffer, sizeof(buffer), 0 );
+    if ( got <= 0 )
+      return false;
+    pending.append( buffer, got );
+  }
+
+  stringstream head( pending.substr( 0, headerEnd ) );
+  pending.erase( 0, headerEnd + 4 );
+
+  string line;
+  std::getline( head, line );
+  stringstream requestLine( line );
+  requestLine >> request.method >> request.path;
+
+  request.headers.clear();
+  while ( std::getline( head, line ) )
+  {
+    size_t colon = line.find( ':' );
+    if ( colon == string::npos )
+      continue;
+    string name = lowerCase( trim( line.substr( 0, colon ) ) );
+    request.headers[ name ] = trim( line.substr( colon + 1 ) );
+  }
+
+  return request.method != "";
+}
+
+bool sendAll( Mock::Connection& connection, const char* data, size_t size,
+              bool throttled )
+{
+  // Sent in slices, pacing them to the bandwidth cap and growing the slow
+  // start window one round trip at a time
+  size_t sent = 0;
+  while ( sent < size )
+  {
+    size_t slice = size - sent;
+    if ( throttled and options.bandwidth > 0 and
+         slice > options.bandwidth / 20 )
+      slice = (size_t)( options.bandwidth / 20 ) + 1;
+    if ( throttled and connection.roundSize > 0 and 
+         slice > connection.window )
+      slice = (size_t) connection.window;
+
+    ssize_t wrote = send( connection.socket, data + sent, slice,
+                          MSG_NOSIGNAL );
+    if ( wrote <= 0 )
+      return false;
+    sent += wrote;
+
+    if ( ! throttled )
+      continue;
+
+    if ( options.bandwidth > 0 )
+      sleepFor( wrote / options.bandwidth );
+
+    if ( connection.roundSize > 0 )
+    {
+      connection.window -= wrote;
+      if ( connection.window <= 0 )
+      {
+        // Round trip over, so wait for the "acknowledgement" and double
+        // the window. Once the cap fits in a round trip slow start is
+        // over.
+        sleepFor( options.latency );
+        connection.roundSize *= 2;
+        connection.window = connection.roundSize;
+
+        double steadyState = options.bandwidth > 0 ? 
+                             options.bandwidth * options.latency : 1e9;
+        if ( connection.roundSize >= steadyState )
+          connection.roundSize = 0;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool readFile( const string& path, string& data, time_t& modified )
+{
+  struct stat status;
+  if ( stat( path.c_str(), &status ) != 0 or ! S_ISREG( status.st_mode ) )
+    return false;
+  modified = status.st_mtime;
+
+  FILE* file = fopen( path.c_str(), "rb" );
+  if ( file == NULL )
+    return false;
+
+  data.clear();
+  char buffer[ 16384 ];
+  size_t length;
+  while ( ( length = fread( buffer, 1, sizeof(buffer), file ) ) > 0 )
+    data.append( buffer, length );
+  fclose( file );
+  return true;
+}
+
+void describeDirectory( const string& directory, stringstream& state )
+{
+  // Every file's name, size and modification time, in a stable order
+  DIR* listing = opendir( directory.c_str() );
+  if ( listing == NULL )
+    return;
+
+  std::set<string> names;
+  struct dirent* entry;
+  while ( ( entry = readdir( listing ) ) != NULL )
+    if ( entry -> d_name[0] != '.' )
+      names.insert( entry -> d_name );
+  closedir( listing );
+
+  for ( std::set<string>::iterator name = names.begin(); 
+        name != names.end(); name++ )
+  {
+    string path = directory + "/" + *name;
+    struct stat status;
+    if ( stat( path.c_str(), &status ) != 0 )
+      continue;
+
+    if ( S_ISDIR( status.st_mode ) )
+      describeDirectory( path, state );
+    else
+      state << path << " " << status.st_size << " " 
+            << status.st_mtime << "\n";
+  }
+}
+
+string directoryState()
+{
+  stringstream state;
+  describeDirectory( options.directory, state );
+  return "\"" + hashContent( state.str() ) + "\"";
+}
+
+bool respondWatch( Mock::Connection& connection, 
+                   const Mock::Request& request )
+{
+  // Held whilst the client's idea of the state is still the current one
+  map<string, string>::const_iterator ifNoneMatch;
+  ifNoneMatch = request.headers.find( "if-none-match" );
+
+  string state = directoryState();
+  if ( ifNoneMatch != request.headers.end() )
+  {
+    double held = 0;
+    while ( ifNoneMatch -> second == state and held < options.holdTime )
+    {
+      sleepFor( 0.1 );
+      held += 0.1;
+      state = directoryState();
+    }
+  }
+
+  stringstream head;
+  string body;
+  if ( ifNoneMatch != request.headers.end() and 
+       ifNoneMatch -> second == state )
+    head << "HTTP/1.1 304 Not Modified\r\n";
+  else
+  {
+    head << "HTTP/1.1 200 OK\r\n";
+    body = state + "\n";
+  }
+
+  head << "ETag: " << state << "\r\n"
+       << "Cache-Control: no-cache\r\n"
+       << "Content-Length: " << body.size() << "\r\n"
+       << "Connection: keep-alive\r\n\r\n";
+
+  string headText = head.str();
+  if ( ! sendAll( connection, headText.data(), headText.size(), false ) )
+    return false;
+  if ( request.method == "HEAD" )
+    return true;
+  return sendAll( connection, body.data(), body.size(), true );
+}
+
+bool respond( Mock::Connection& connection, const Mock::Request& request )
+{
+  sleepFor( options.latency );
+
+  string path = request.path.substr( 0, request.path.find( '?' ) );
+  if ( path == options.watchPath and request.method == "GET" )
+    return respondWatch( connection, request );
+
+  string data;
+  time_t modified = 0;
+  bool found = path.find( ".." ) == string::npos and
+               readFile( options.directory + path, data, modified );
+
+  stringstream head;
+  string body;
+  if ( request.method != "GET" and request.method != "HEAD" )
+  {
+    head << "HTTP/1.1 405 Method Not Allowed\r\n";
+    body = "Method not allowed\n";
+  }
+  else if ( ! found )
+  {
+    head << "HTTP/1.1 404 Not Found\r\n";
+    body = "Not found\n";
+  }
+  else
+  {
+    string etag = "\"" + hashContent( data ) + "\"";
+    string lastModified = httpDate( modified );
+
+    map<string, string>::const_iterator ifNoneMatch;
+    map<string, string>::const_iterator ifModifiedSince;
+    ifNoneMatch     = request.headers.find( "if-none-match" );
+    ifModifiedSince = request.headers.find( "if-modified-since" );
+
+    bool notModified = false;
+    if ( options.honourConditional )
+    {
+      if ( ifNoneMatch != request.headers.end() )
+        notModified = ifNoneMatch -> second == etag;
+      else if ( ifModifiedSince != request.headers.end() )
+        notModified = ifModifiedSince -> second == lastModified;
+    }
+
+    // A range is only served if the client's copy is still current
+    map<string, string>::const_iterator range, ifRange;
+    range   = request.headers.find( "range" );
+    ifRange = request.headers.find( "if-range" );
+
+    long rangeStart = -1;
+    if ( range != request.headers.end() and
+         range -> second.compare( 0, 6, "bytes=" ) == 0 and
+         range -> second.find_first_of( ",", 6 ) == string::npos and
+         range -> second[ range -> second.size() - 1 ] == '-' )
+      rangeStart = atol( range -> second.c_str() + 6 );
+
+    if ( ifRange != request.headers.end() and 
+         ifRange -> second != etag and ifRange -> second != lastModified )
+      rangeStart = -1;
+
+    if ( notModified )
+      head << "HTTP/1.1 304 Not Modified\r\n";
+    else if ( rangeStart >= (long) data.size() )
+    {
+      head << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+           << "Content-Range: bytes */" << data.size() << "\r\n";
+    }
+    else if ( rangeStart >= 0 )
+    {
+      head << "HTTP/1.1 206 Partial Content\r\n"
+           << "Content-Range: bytes " << rangeStart << "-" 
+           << data.size() - 1 << "/" << data.size() << "\r\n";
+      body = data.substr( rangeStart );
+    }
+    else
+    {
+      head << "HTTP/1.1 200 OK\r\n";
+      body = data;
+    }
+
+    head << "Accept-Ranges: bytes\r\n";
+
+    head << "ETag: " << etag << "\r\n"
+         << "Last-Modified: " << lastModified << "\r\n";
+  }
+
+  head << "Content-Length: " << body.size() << "\r\n"
+       << "Connection: keep-alive\r\n\r\n";
+
+  string headText = head.str();
+  if ( ! sendAll( connection, headText.data(), headText.size(), false ) )
+    return false;
+
+  if ( request.method == "HEAD" )
+    return true;
+
+  // A link that goes down mid transfer
+  if ( body.size() > 1 and chance( options.cutRate ) )
+  {
+    sendAll( connection, body.data(), body.size() / 2, true );
+    return false;
+  }
+
+  return sendAll( connection, body.data(), body.size(), true );
+}
+
+void* serveConnection( void* data )
+{
+  Mock::Connection connection;
+  connection.socket = (int)(intptr_t) data;
+  connection.roundSize = options.slowStart;
+  connection.window    = options.slowStart;
+
+  int noDelay = 1;
+  setsockopt( connection.socket, IPPROTO_TCP, TCP_NODELAY,
+              &noDelay, sizeof(noDelay) );
+
+  string pending;
+  Mock::Request request;
+  while ( readRequest( connection.socket, pending, request ) )
+  {
+    cerr << request.method << " " << request.path << endl;
+
+    // A dropped connection, as a flaky VM link would
+    if ( chance( options.failRate ) )
+      break;
+
+    if ( ! respond( connection, request ) )
+      break;
+  }
+
+  close( connection.socket );
+  return NULL;
+}
+
+bool parseOption( const string& argument, const string& name,
+                  string& value )
+{
+  string prefix = "--" + name + "=";
+  if ( argument.compare( 0, prefix.size(), prefix ) != 0 )
+    return false;
+  value = argument.substr( prefix.size() );
+  return true;
+}
+
+int main( int argc, char** argv )
+{
+  options.directory         = "TestServe/files";
+  options.port              = 7859;
+  options.latency           = 0;
+  options.bandwidth         = 0;
+  options.slowStart         = 0;
+  options.failRate          = 0;
+  options.cutRate           = 0;
+  options.honourConditional = true;
+  options.watchPath         = "/watch";
+  options.holdTime          = 25;
+
+  for ( int i = 1; i < argc; i++ )
+  {
+    string argument = argv[i];
+    string value;
+    if ( parseOption( argument, "dir", value ) )
+      options.directory = value;
+    else if ( parseOption( argument, "port", value ) )
+      options.port = atoi( value.c_str() );
+    else if ( parseOption( argument, "latency", value ) )
+      options.latency = atof( value.c_str() ) / 1000;
+    else if ( parseOption( argument, "bandwidth", value ) )
+      options.bandwidth = atof( value.c_str() );
+    else if ( parseOption( argument, "slowstart", value ) )
+      options.slowStart = atof( value.c_str() );
+    else if ( parseOption( argument, "fail", value ) )
+      options.failRate = atof( value.c_str() );
+    else if ( parseOption( argument, "cut", value ) )
+      options.cutRate = atof( value.c_str() );
+    else if ( parseOption( argument, "conditional", value ) )
+      options.honourConditional = value != "ignore";
+    else if ( parseOption( argument, "watch", value ) )
+      options.watchPath = value;
+    else if ( parseOption( argument, "hold", value ) )
+      options.holdTime = atof( value.c_str() );
+    else
+    {
+      cerr << "Unknown option " << argument << endl;
+      return 1;
+    }
+  }
+
+  signal( SIGPIPE, SIG_IGN );
+
+  int listener = socket( AF_INET, SOCK_STREAM, 0 );
+  int reuse = 1;
+  setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+
+  struct sockaddr_in address;
+  memset( &address, 0, sizeof(address) );
+  address.sin_family      = AF_INET;
+  address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  address.sin_port        = htons( options.port );
+
+  if ( bind( listener, (struct sockaddr*) &address, sizeof(address) ) != 0
+       or listen( listener, 64 ) != 0 )
+  {
+    cerr << "Unable to listen on port " << options.port << endl;
+    return 1;
+  }
+
+  cerr << "Serving " << options.directory << " on port " << options.port
+       << endl;
+
+  while ( true )
+  {
+    int client = accept( listener, NULL, NULL );
+    if ( client < 0 )
+      continue;
+
+    pthread_t thread;
+    if ( pthread_create( &thread, NULL, &serveConnection,
+                         (void*)(intptr_t) client ) != 0 )
+    {
+      close( client );
+      continue;
+    }
+    pthread_detach( thread );
+  }
+
+  return 0;
+}
@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////
+// checks - quick runnable checks of the parts that can go wrong quietly
+//
+//   ./checks [server] [served directory]
+//
+// Most need nothing but themselves. Those that download do so from a
+// TestServe/mockserver run with --cut=1 (every body cut off half way)
+// over the served directory, which they write their files into. "make
+// check" sets all that up. Prints a line per failure and exits non-zero
+// if there were any.
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+
+//cURL
+#include <curl/curl.h>
+
+//BOINC
+#include "util.h"
+
+//Our stuff
+#include "boincShare.h"
+#include "networking.h"
+#include "tasks.h"
+#include "bundle.h"
+#include "resources.h"
+
+// The screensaver's objects are linked in, so these need to exist
+Share::SharedData* Share::data;
+
+void app_graphics_render(int xs, int ys, double timestamp) {}
+void app_graphics_resize(int width, int height) {}
+void app_graphics_init() {}
+void boinc_app_mouse_move(int x, int y, int left, int middle, int right){}
+void boinc_app_mouse_button(int x, int y, int which, int is_down){}
+void boinc_app_key_press(int key, int){}
+void boinc_app_key_release(int, int){}
+
+int checksRun    = 0;
+int checksFailed = 0;
+
+void check( bool passed, string what )
+{
+  checksRun++;
+  if ( passed )
+    return;
+
+  checksFailed++;
+  cout << "FAILED: " << what << endl;
+}
+
+Resources::Hash hashOf( string document )
+{
+  Json::Value value;
+  Resources::parseDocument( document, value );
+  return Resources::hashValue( value );
+}
+
+void checkHashes()
+{
+  // Member order and formatting make no difference, anything else does
+  Resources::Hash plain = hashOf( "{\"a\":1,\"b\":[1,2,{\"c\":\"x\"}]}" );
+  check( plain == hashOf( "{ \"b\" : [ 1, 2, { \"c\" : \"x\" } ],\n"
+                          "  \"a\" : 1 }" ),
+         "hashValue ignores member order and formatting" );
+  check( plain != hashOf( "{\"a\":1.0,\"b\":[1,2,{\"c\":\"x\"}]}" ),
+         "hashValue tells 1 from 1.0" );
+  check( plain != hashOf( "{\"a\":1,\"b\":[2,1,{\"c\":\"x\"}]}" ),
+         "hashValue keeps array order" );
+  check( hashOf( "{\"ab\":\"x\"}" ) != hashOf( "{\"a\":\"bx\"}" ),
+         "hashValue keeps keys and values apart" );
+  check( hashOf( "[]" ) != hashOf( "{}" ),
+         "hashValue tells an empty array from an empty object" );
+}
+
+void setDocument( Resources::ResourcesMap& documents,
+                  Resources::HashMap& hashes,
+                  string name, string document )
+{
+  Resources::parseDocument( document, documents[ name ] );
+  hashes[ name ] = Resources::hashValue( documents[ name ] );
+}
+
+void checkNodeHandles()
+{
+  Resources::ResourcesMap documents;
+  Resources::HashMap      hashes;
+  setDocument( documents, hashes, "doc",
+               "{\"a\":{\"b/c\":[10,20]},\"s\":{\"k\":1}}" );
+  setDocument( documents, hashes, "other", "{\"z\":1}" );
+  Resources::publish( documents, hashes );
+
+  Resources::NodeHandle escaped( "doc", "/a/b~1c/1" );
+  Resources::NodeHandle named( "doc", "s" );
+  check( escaped.node().asInt() == 20, "NodeHandle follows escapes" );
+  check( named.node()["k"].asInt() == 1, "NodeHandle takes a plain name" );
+  check( ! named.stale(), "NodeHandle is current once looked up" );
+
+  // Publishing another document, or the same one again, leaves it be
+  setDocument( documents, hashes, "other", "{\"z\":2}" );
+  Resources::publish( documents, hashes );
+  check( ! named.stale(), "NodeHandle survives other documents changing" );
+  Resources::publish( documents, hashes );
+  check( ! named.stale(), "NodeHandle survives an unchanged publish" );
+
+  setDocument( documents, hashes, "doc", "{\"s\":{\"k\":5}}" );
+  Resources::publish( documents, hashes );
+  check( named.stale(), "NodeHandle goes stale when its document does" );
+  check( named.node()["k"].asInt() == 5, "NodeHandle finds the new node" );
+  check( escaped.node().isNull(), "NodeHandle to a lost node is null" );
+
+  documents.erase( "doc" );
+  Resources::publish( documents, hashes );
+  check( named.stale() and named.node().isNull(),
+         "NodeHandle goes stale when its document is removed" );
+}
+
+void checkRetryDelays()
+{
+  // Between half and all of 0.5s doubling per attempt, capped at 60s
+  double base = 0.5;
+  for ( int attempts = 1; attempts <= 30; attempts++ )
+  {
+    double ceiling = base < 60 ? base : 60;
+    bool inBounds = true;
+    for ( int i = 0; i < 100; i++ )
+    {
+      double delay = Networking::retryDelay( attempts );
+      inBounds = inBounds and delay >= ceiling / 2 and delay <= ceiling;
+    }
+    check( inBounds, "retryDelay within bounds" );
+    base *= 2;
+  }
+}
+
+bool readsContents( string bundle, size_t entries = 0 )
+{
+  Bundle::Archive archive;
+  archive.data   = bundle.data();
+  archive.size   = bundle.size();
+  archive.mapped = false;
+  bool read = Bundle::readContents( archive );
+  return read and archive.contents.size() == entries;
+}
+
+void checkBundles()
+{
+  string magic = "CVMBUNDLE 1\n";
+  string contents = "[{\"path\":\"/a\",\"hash\":\"h\",\"offset\":0,"
+                    "\"length\":2},"
+                    "{\"path\":\"/b\",\"hash\":\"h\",\"offset\":1,"
+                    "\"length\":9}]";
+  char length[ 32 ];
+  snprintf( length, sizeof(length), "%d\n", (int) contents.size() );
+
+  check( readsContents( magic + length + contents + "ab", 1 ),
+         "Bundle contents read, out of bounds entries dropped" );
+  check( ! readsContents( "CVMBUNDLE 2\n" + string( length ) + contents ),
+         "Bundle with the wrong header rejected" );
+  check( ! readsContents( magic + "\n" + contents ),
+         "Bundle with an empty length rejected" );
+  check( ! readsContents( magic + "12" ),
+         "Bundle with an unfinished length rejected" );
+  check( ! readsContents( magic + "9999\n" + contents ),
+         "Bundle contents longer than the file rejected" );
+  check( ! readsContents( magic + "99999999999999999999999\n" + contents ),
+         "Bundle length that overflows rejected" );
+  check( ! readsContents( magic + "0\n" + contents ),
+         "Bundle with no contents rejected" );
+}
+
+int outstanding;
+
+void downloaded( CURL* easyHandle, void* data )
+{
+  outstanding--;
+}
+
+void waitForOutstanding()
+{
+  double started = dtime();
+  while ( outstanding > 0 and dtime() - started < 30 )
+  {
+    Networking::fileDownloader -> process();
+    Tasks::process();
+    boinc_sleep( 0.01 );
+  }
+}
+
+void writeFile( string path, string content )
+{
+  FILE* file = fopen( path.c_str(), "wb" );
+  if ( file == NULL )
+    return;
+  fwrite( content.data(), 1, content.size(), file );
+  fclose( file );
+}
+
+string readFile( string path )
+{
+  string content;
+  FILE* file = fopen( path.c_str(), "rb" );
+  if ( file == NULL )
+    return content;
+
+  char buffer[ 256 ];
+  size_t length;
+  while ( ( length = fread( buffer, 1, sizeof(buffer), file ) ) > 0 )
+    content.append( buffer, length );
+  fclose( file );
+  return content;
+}
+
+void checkResume( string served )
+{
+  // With every body cut in half, a file only arrives by resuming, and
+  // only if If-Range carries the validator the server sent
+  using Networking::fileDownloader;
+  writeFile( served + "/resume.txt", "abcd" );
+
+  Networking::FileInformation info;
+  info . finishResponse = &downloaded;
+  outstanding = 1;
+  fileDownloader -> addFile( "/resume.txt", info );
+  waitForOutstanding();
+  check( outstanding == 0 and readFile( "dispFiles/resume.txt" ) == "abcd",
+         "prepareResume resumes with If-Range" );
+
+  // Change the file while the retry waits out its backoff. The server
+  // sees the old validator in If-Range and sends the new file whole, so
+  // it mustn't be spliced onto the start of the old one.
+  writeFile( served + "/changed.txt", "abcd" );
+  outstanding = 1;
+  fileDownloader -> addFile( "/changed.txt", info );
+  boinc_sleep( 0.1 );
+  fileDownloader -> process();
+  writeFile( served + "/changed.txt", "wxyz" );
+  waitForOutstanding();
+  check( outstanding == 0 and readFile( "dispFiles/changed.txt" ) == "wxyz",
+         "prepareResume starts afresh when If-Range doesn't match" );
+}
+
+int main( int argc, char** argv )
+{
+  string server = "http://localhost:7859";
+  string served = "";
+  if ( argc > 1 ) server = argv[1];
+  if ( argc > 2 ) served = argv[2];
+
+  Networking::fileDownloader = new Networking::FileDownloader( server );
+
+  checkHashes();
+  checkNodeHandles();
+  checkRetryDelays();
+  checkBundles();
+  if ( served != "" )
+    checkResume( served );
+  else
+    cout << "No served directory given, resume checks skipped" << endl;
+
+  delete Networking::fileDownloader;
+
+  cout << checksRun - checksFailed << " of " << checksRun
+       << " checks passed" << endl;
+  return checksFailed == 0 ? 0 : 1;
+}
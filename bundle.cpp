@@ -0,0 +1,284 @@
+//Our stuff
+#include "bundle.h"
+#include "networking.h"
+#include "tasks.h"
+#include "cache.h"
+#include "errors.h"
+
+//JsonCpp
+#include "json/json.h"
+
+//Std
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+
+//mmap
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::endl;
+
+const char   bundleMagic[] = "CVMBUNDLE 1\n";
+const size_t bundleMagicLength = sizeof(bundleMagic) - 1;
+
+bool mapFile( string localPath, Bundle::Archive& archive )
+{
+#ifndef _WIN32
+  int descriptor = ::open( localPath.c_str(), O_RDONLY );
+  if ( descriptor < 0 )
+    return false;
+
+  struct stat status;
+  if ( fstat( descriptor, &status ) != 0 or status.st_size == 0 )
+  {
+    ::close( descriptor );
+    return false;
+  }
+
+  void* mapping = mmap( NULL, status.st_size, PROT_READ, MAP_PRIVATE,
+                        descriptor, 0 );
+  ::close( descriptor );
+  if ( mapping == MAP_FAILED )
+    return false;
+
+  archive.data   = (const char*) mapping;
+  archive.size   = status.st_size;
+  archive.mapped = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool readFile( string localPath, Bundle::Archive& archive )
+{
+  FILE* file = fopen( localPath.c_str(), "rb" );
+  if ( file == NULL )
+    return false;
+
+  fseek( file, 0, SEEK_END );
+  long size = ftell( file );
+  fseek( file, 0, SEEK_SET );
+
+  char* data = NULL;
+  if ( size > 0 )
+    data = new char[ size ];
+
+  bool readOk = data != NULL and
+                fread( data, 1, size, file ) == (size_t) size;
+  fclose( file );
+
+  if ( ! readOk )
+  {
+    delete [] data;
+    return false;
+  }
+
+  archive.data   = data;
+  archive.size   = size;
+  archive.mapped = false;
+  return true;
+}
+
+bool Bundle::open( string localPath, Bundle::Archive& archive )
+{
+  archive.data     = NULL;
+  archive.size     = 0;
+  archive.body     = NULL;
+  archive.bodySize = 0;
+  archive.mapped   = false;
+  archive.contents.clear();
+
+  if ( ! mapFile( localPath, archive ) and
+       ! readFile( localPath, archive ) )
+    return false;
+
+  if ( ! Bundle::readContents( archive ) )
+  {
+    Bundle::close( archive );
+    return false;
+  }
+
+  return true;
+}
+
+void Bundle::close( Bundle::Archive& archive )
+{
+  if ( archive.data == NULL )
+    return;
+
+#ifndef _WIN32
+  if ( archive.mapped )
+    munmap( (void*) archive.data, archive.size );
+  else
+#endif
+    delete [] archive.data;
+
+  archive.data = NULL;
+  archive.size = 0;
+  archive.body = NULL;
+}
+
+bool Bundle::readContents( Bundle::Archive& archive )
+{
+  // Header first, then the length of the table of contents on a line of
+  // its own
+  const char* data = archive.data;
+  size_t size = archive.size;
+
+  if ( size < bundleMagicLength or
+       memcmp( data, bundleMagic, bundleMagicLength ) != 0 )
+    return false;
+
+  size_t position = bundleMagicLength;
+  size_t contentsLength = 0;
+  while ( position < size and data[ position ] != '\n' )
+  {
+    if ( data[ position ] < '0' or data[ position ] > '9' )
+      return false;
+    contentsLength = contentsLength * 10 + ( data[ position ] - '0' );
+    position++;
+
+    // Stops a run of digits overflowing, it couldn't fit anyway
+    if ( contentsLength > size )
+      return false;
+  }
+
+  // No length at all, or no end to the line, and it's not a bundle
+  if ( position == bundleMagicLength or position == size )
+    return false;
+  position++;
+
+  if ( contentsLength == 0 or contentsLength > size - position )
+    return false;
+
+  Json::Value contents;
+  Json::Reader reader;
+  if ( ! reader.parse( data + position, data + position + contentsLength,
+                       contents ) or ! contents.isArray() )
+    return false;
+
+  archive.body     = data + position + contentsLength;
+  archive.bodySize = size - position - contentsLength;
+
+  // Entries that don't fit in the bundle are dropped, the rest are fine
+  for ( Json::Value::UInt i = 0; i < contents.size(); i++ )
+  {
+    Bundle::Entry entry;
+    entry.path   = contents[i]["path"].asString();
+    entry.hash   = contents[i]["hash"].asString();
+    entry.offset = contents[i]["offset"].asUInt();
+    entry.length = contents[i]["length"].asUInt();
+    entry.etag         = contents[i]["etag"].asString();
+    entry.lastModified = contents[i]["lastModified"].asString();
+
+    if ( entry.path == "" or entry.offset > archive.bodySize or
+         entry.length > archive.bodySize - entry.offset )
+    {
+      Errors::err << "Bundle entry \"" << entry.path
+                  << "\" is out of bounds" << endl;
+      continue;
+    }
+
+    archive.contents.push_back( entry );
+  }
+
+  return true;
+}
+
+int Bundle::unpack( const Bundle::Archive& archive,
+                    vector<string>& unpacked )
+{
+  // Files we already have are simply pointed at, the rest are checked
+  // against their hash and copied in
+  using Networking::fileDownloader;
+
+  for ( size_t i = 0; i < archive.contents.size(); i++ )
+  {
+    const Bundle::Entry& entry = archive.contents[i];
+    string url = fileDownloader -> pathFromString( entry.path );
+    const char* bytes = archive.body + entry.offset;
+
+    // The validators the bundle gives, failing that those the server sent
+    // last time if the content is the same - never none, or the next
+    // request for the file couldn't be conditional
+    Cache::Entry validators;
+    if ( ! Cache::lookup( url, validators ) or 
+         validators.hash != entry.hash )
+      validators = Cache::Entry();
+    if ( entry.etag != "" or entry.lastModified != "" )
+    {
+      validators.etag         = entry.etag;
+      validators.lastModified = entry.lastModified;
+    }
+
+    bool stored = Cache::adopt( url, entry.hash, validators );
+
+    if ( ! stored and
+         Cache::hashBytes( bytes, entry.length ) == entry.hash )
+      stored = Cache::storeBytes( url, bytes, entry.length, validators );
+
+    if ( stored )
+      unpacked.push_back( entry.path );
+  }
+
+  return unpacked.size();
+}
+
+void unpackBundle( void* data )
+{
+  // Worker thread - the cache does its own locking
+  Bundle::Install* install = (Bundle::Install*) data;
+
+  Bundle::Archive archive;
+  install -> installed = Bundle::open( install -> localPath, archive );
+  if ( install -> installed )
+  {
+    Bundle::unpack( archive, install -> unpacked );
+    Bundle::close( archive );
+  }
+}
+
+void bundleUnpacked( void* data )
+{
+  Bundle::Install* install = (Bundle::Install*) data;
+  using Networking::fileDownloader;
+
+  if ( install -> installed )
+    Errors::dbg << "Bundle " << install -> localPath << " provided "
+                << install -> unpacked.size() << " files" << endl;
+  else
+    Errors::err << "Bundle " << install -> localPath << " is invalid, "
+                << "fetching files individually" << endl;
+
+  // Anything the bundle didn't cover goes to the server as normal
+  fileDownloader -> setFresh( install -> unpacked );
+
+  if ( install -> done != NULL )
+    (*(install -> done))( install -> installed, install -> userData );
+
+  delete install;
+}
+
+void Bundle::install( string filename, Bundle::installedFunc installed,
+                      void* userData )
+{
+  Bundle::Install* install = new Bundle::Install;
+  install -> localPath = "./dispFiles/" + filename;
+  install -> installed = false;
+  install -> done      = installed;
+  install -> userData  = userData;
+
+  Tasks::post( &unpackBundle, &bundleUnpacked, install );
+}
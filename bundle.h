@@ -0,0 +1,80 @@
+#ifndef BUNDLE_H_INC
+#define BUNDLE_H_INC
+
+#include <string>
+#include <vector>
+
+// Asset bundles - every file a configuration needs, in one transfer
+//
+// A bundle is a small text header, a table of contents and then the files
+// themselves, back to back:
+//
+//   CVMBUNDLE 1\n
+//   <length of the table of contents, in bytes>\n
+//   <table of contents>
+//   <file data>
+//
+// The table of contents is a JSON list of entries, each giving a file's
+// path on the server, its hash (as Cache::hashBytes()) and where its bytes
+// lie, relative to the start of the file data:
+//
+//   [ {"path":"/event.png", "hash":"...", "offset":0, "length":33298} ]
+//
+// Entries may also give the "etag" and "lastModified" the server sends
+// with the file, so later requests for it can be conditional.
+//
+// TestServe/mkbundle.py makes them. Installed bundles are unpacked into
+// the download cache, and the files in them are then served from there
+// without a request each.
+namespace Bundle
+{
+  struct Entry
+  {
+    std::string path;
+    std::string hash;
+    size_t      offset;
+    size_t      length;
+    std::string etag;
+    std::string lastModified;
+  };
+
+  typedef std::vector< Entry > Contents;
+
+  // An open bundle. The file is mapped into memory where the platform
+  // allows, and read in otherwise.
+  struct Archive
+  {
+    const char* data;
+    size_t      size;
+    const char* body;
+    size_t      bodySize;
+    Contents    contents;
+    bool        mapped;
+  };
+
+  bool open ( std::string localPath, Archive& archive );
+  void close( Archive& archive );
+  bool readContents( Archive& archive );
+
+  // Puts every entry into the cache, listing those that made it
+  int unpack( const Archive& archive, std::vector<std::string>& unpacked );
+
+  // Called on the render thread once an install() is done
+  typedef void (*installedFunc)( bool installed, void* userData );
+
+  // Unpacks a downloaded bundle on a worker thread, then marks its files
+  // fresh with the file downloader
+  void install( std::string filename, installedFunc installed,
+                void* userData );
+
+  struct Install
+  {
+    std::string               localPath;
+    std::vector<std::string>  unpacked;
+    bool                      installed;
+    installedFunc             done;
+    void*                     userData;
+  };
+};
+
+#endif //Include guard
@@ -0,0 +1,460 @@
+//Ours
+#include "cache.h"
+#include "errors.h"
+
+//boinc
+#include "filesys.h"
+#include "util.h"
+
+//JsonCpp
+#include "json/json.h"
+
+//Standard
+#include <cstdio>
+#include <string>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+
+//pthreads
+#include <pthread.h>
+
+//link
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::ifstream;
+using std::ofstream;
+using std::endl;
+
+Cache::CacheIndex Cache::cacheIndex;
+
+const string cacheDirectory = "./dispFiles/cache";
+const string cacheIndexFile = "./dispFiles/cache/index.json";
+
+// Both the render and network threads use the cache, this guards the
+// index and the writing of new blobs.
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The blobs on disk, by hash. Once they add up to more than cacheLimit
+// the least recently used go, along with the index entries naming them.
+struct Blob
+{
+  double size;
+  double lastUsed;
+};
+
+typedef std::map< string, Blob > BlobTable;
+
+BlobTable    blobs;
+double       cacheBytes = 0;
+const double cacheLimit = 256 * 1024 * 1024;
+
+// Changes to the index are written out at most this often, rather than
+// on every store (see Cache::flush())
+bool         indexDirty   = false;
+double       indexWritten = 0;
+const double indexWriteInterval = 5;
+
+string hashToString( uint64_t hash )
+{
+  char hex[17];
+  snprintf( hex, sizeof(hex), "%016llx", (unsigned long long) hash );
+  return string( hex );
+}
+
+void Cache::hashUpdate( uint64_t& hash, const void* data, size_t length )
+{
+  // Quick, and plenty for telling files apart
+  const unsigned char* bytes = (const unsigned char*) data;
+  for ( size_t i = 0; i < length; i++ )
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+}
+
+string Cache::hashBytes( const char* data, size_t length )
+{
+  uint64_t hash = Cache::hashSeed;
+  Cache::hashUpdate( hash, data, length );
+  return hashToString( hash );
+}
+
+string Cache::hashFile( string path )
+{
+  FILE* file = fopen( path.c_str(), "rb" );
+  if ( file == NULL )
+    return "";
+
+  uint64_t hash = Cache::hashSeed;
+  char buffer[ 16384 ];
+  size_t length;
+  while ( ( length = fread( buffer, 1, sizeof(buffer), file ) ) > 0 )
+    Cache::hashUpdate( hash, buffer, length );
+
+  fclose( file );
+  return hashToString( hash );
+}
+
+string Cache::blobPath( string hash )
+{
+  return cacheDirectory + "/" + hash;
+}
+
+void Cache::load()
+{
+  boinc_mkdir( cacheDirectory.c_str() );
+
+  ifstream indexFile( cacheIndexFile.c_str() );
+  if ( ! indexFile )
+    return;
+
+  Json::Value index;
+  Json::Reader reader;
+  if ( ! reader.parse( indexFile, index ) )
+  {
+    Errors::err << "Cache index is invalid JSON, starting afresh" << endl;
+    return;
+  }
+
+  std::map< string, double > used;
+  for ( Json::ValueIterator itr  = index.begin(); 
+                            itr != index.end(); 
+                            itr++ )
+  {
+    string url = itr.key().asString();
+    Cache::Entry entry;
+    entry.hash         = index[ url ]["hash"].asString();
+    entry.etag         = index[ url ]["etag"].asString();
+    entry.lastModified = index[ url ]["lastModified"].asString();
+    Cache::cacheIndex[ url ] = entry;
+
+    double lastUsed = index[ url ]["used"].asDouble();
+    if ( lastUsed > used[ entry.hash ] )
+      used[ entry.hash ] = lastUsed;
+  }
+
+  // Blobs nothing names (left by a crash before the index was written)
+  // would never be evicted, so they go now
+  DirScanner scanner( cacheDirectory );
+  string name;
+  while ( scanner.scan( name ) )
+  {
+    string path = cacheDirectory + "/" + name;
+    if ( path == cacheIndexFile )
+      continue;
+    if ( used.find( name ) == used.end() )
+    {
+      boinc_delete_file( path.c_str() );
+      continue;
+    }
+
+    Blob blob;
+    blob.lastUsed = used[ name ];
+    file_size( path.c_str(), blob.size );
+    blobs[ name ] = blob;
+    cacheBytes += blob.size;
+  }
+}
+
+void writeIndex()
+{
+  // cacheLock must be held
+  Json::Value index( Json::objectValue );
+  for ( Cache::CacheIndex::iterator itr  = Cache::cacheIndex.begin();
+                                    itr != Cache::cacheIndex.end();
+                                    itr++ )
+  {
+    Json::Value& entry = index[ itr -> first ];
+    entry["hash"]         = itr -> second . hash;
+    entry["etag"]         = itr -> second . etag;
+    entry["lastModified"] = itr -> second . lastModified;
+
+    BlobTable::iterator blob = blobs.find( itr -> second . hash );
+    if ( blob != blobs.end() )
+      entry["used"] = blob -> second . lastUsed;
+  }
+
+  // Written aside and moved into place, so a crash can't leave half an
+  // index behind
+  string partFile = cacheIndexFile + ".part";
+  ofstream indexFile( partFile.c_str() );
+  Json::FastWriter writer;
+  indexFile << writer.write( index );
+  indexFile.close();
+
+  boinc_rename( partFile.c_str(), cacheIndexFile.c_str() );
+  indexDirty   = false;
+  indexWritten = dtime();
+}
+
+void indexChanged()
+{
+  // cacheLock must be held
+  indexDirty = true;
+  if ( dtime() - indexWritten >= indexWriteInterval )
+    writeIndex();
+}
+
+void useBlob( string hash, double size )
+{
+  // cacheLock must be held. Notes a blob just written or reused.
+  BlobTable::iterator blob = blobs.find( hash );
+  if ( blob == blobs.end() )
+  {
+    Blob added;
+    added.size = size;
+    blob = blobs.insert( std::make_pair( hash, added ) ).first;
+    cacheBytes += size;
+  }
+  blob -> second . lastUsed = dtime();
+}
+
+void evictBlobs( string keep )
+{
+  // cacheLock must be held. Drops least recently used blobs until the 
+  // cache fits its limit, sparing the one just stored.
+  while ( cacheBytes > cacheLimit )
+  {
+    BlobTable::iterator oldest = blobs.end();
+    for ( BlobTable::iterator itr = blobs.begin(); itr != blobs.end(); 
+          itr++ )
+    {
+      if ( itr -> first != keep and ( oldest == blobs.end() or
+           itr -> second . lastUsed < oldest -> second . lastUsed ) )
+        oldest = itr;
+    }
+    if ( oldest == blobs.end() )
+      return;
+
+    string hash = oldest -> first;
+    boinc_delete_file( Cache::blobPath( hash ).c_str() );
+    cacheBytes -= oldest -> second . size;
+    blobs.erase( oldest );
+
+    Cache::CacheIndex::iterator entry = Cache::cacheIndex.begin();
+    while ( entry != Cache::cacheIndex.end() )
+    {
+      if ( entry -> second . hash == hash )
+        Cache::cacheIndex.erase( entry++ );
+      else
+        entry++;
+    }
+    indexDirty = true;
+  }
+}
+
+bool placeFile( string source, string destination )
+{
+  // Puts a copy of source at destination, written aside and moved into
+  // place so nothing ever sees half a file. Where the platform allows the
+  // copy is a hard link, so the cache doesn't hold a second copy of what
+  // is in dispFiles - safe, as neither side is ever written in place.
+  string partFile = destination + ".part";
+  boinc_delete_file( partFile.c_str() );
+
+  bool placed = false;
+#ifndef _WIN32
+  placed = link( source.c_str(), partFile.c_str() ) == 0;
+#endif
+  if ( ! placed )
+  {
+    FILE* from = fopen( source.c_str(), "rb" );
+    FILE* to   = fopen( partFile.c_str(), "wb" );
+    placed = Cache::copyFile( from, to );
+    if ( from != NULL )
+      fclose( from );
+    if ( to != NULL and fclose( to ) != 0 )
+      placed = false;
+  }
+
+  if ( placed )
+    placed = boinc_rename( partFile.c_str(), destination.c_str() ) == 0;
+
+  // Also covers the two being links to the same file already, when the
+  // rename leaves the part where it is
+  boinc_delete_file( partFile.c_str() );
+  return placed;
+}
+
+void Cache::save()
+{
+  pthread_mutex_lock( &cacheLock );
+  writeIndex();
+  pthread_mutex_unlock( &cacheLock );
+}
+
+void Cache::flush()
+{
+  // Writes out changes held back by indexChanged(), once they're due
+  pthread_mutex_lock( &cacheLock );
+  if ( indexDirty and dtime() - indexWritten >= indexWriteInterval )
+    writeIndex();
+  pthread_mutex_unlock( &cacheLock );
+}
+
+bool Cache::lookup( string url, Cache::Entry& entry )
+{
+  // Only entries whose content is actually on disk are any use
+  pthread_mutex_lock( &cacheLock );
+  Cache::CacheIndex::iterator itr = Cache::cacheIndex.find( url );
+  bool found = itr != Cache::cacheIndex.end();
+  if ( found )
+  {
+    entry = itr -> second;
+    BlobTable::iterator blob = blobs.find( entry.hash );
+    if ( blob != blobs.end() )
+      blob -> second . lastUsed = dtime();
+  }
+  pthread_mutex_unlock( &cacheLock );
+
+  if ( ! found )
+    return false;
+
+  string blob = Cache::blobPath( entry.hash );
+  return boinc_file_exists( blob.c_str() );
+}
+
+bool Cache::store( string url, string localPath, Cache::Entry validators )
+{
+  string hash = Cache::hashFile( localPath );
+  if ( hash == "" )
+    return false;
+
+  // Identical content is only ever kept once
+  string blob = Cache::blobPath( hash );
+  pthread_mutex_lock( &cacheLock );
+  if ( ! boinc_file_exists( blob.c_str() ) and 
+       ! placeFile( localPath, blob ) )
+  {
+    pthread_mutex_unlock( &cacheLock );
+    return false;
+  }
+
+  double size = 0;
+  file_size( blob.c_str(), size );
+  useBlob( hash, size );
+
+  validators.hash = hash;
+  Cache::cacheIndex[ url ] = validators;
+  evictBlobs( hash );
+  indexChanged();
+  pthread_mutex_unlock( &cacheLock );
+  return true;
+}
+
+bool Cache::restore( string url, string localPath )
+{
+  Cache::Entry entry;
+  if ( ! Cache::lookup( url, entry ) )
+    return false;
+
+  return placeFile( Cache::blobPath( entry.hash ), localPath );
+}
+
+bool Cache::storeBytes( string url, const string& data, 
+                        Cache::Entry validators )
+{
+  return Cache::storeBytes( url, data.data(), data.size(), validators );
+}
+
+bool Cache::storeBytes( string url, const char* data, size_t length,
+                        Cache::Entry validators )
+{
+  string hash = Cache::hashBytes( data, length );
+
+  // Written aside like the index, so a blob is never seen half written
+  string blob = Cache::blobPath( hash );
+  pthread_mutex_lock( &cacheLock );
+  if ( ! boinc_file_exists( blob.c_str() ) )
+  {
+    string partFile = blob + ".part";
+    FILE* destination = fopen( partFile.c_str(), "wb" );
+    bool written = false;
+    if ( destination != NULL )
+    {
+      written = fwrite( data, 1, length, destination ) == length;
+      written = fclose( destination ) == 0 and written;
+    }
+
+    if ( ! written or 
+         boinc_rename( partFile.c_str(), blob.c_str() ) != 0 )
+    {
+      boinc_delete_file( partFile.c_str() );
+      pthread_mutex_unlock( &cacheLock );
+      return false;
+    }
+  }
+
+  useBlob( hash, length );
+
+  validators.hash = hash;
+  Cache::cacheIndex[ url ] = validators;
+  evictBlobs( hash );
+  indexChanged();
+  pthread_mutex_unlock( &cacheLock );
+  return true;
+}
+
+bool Cache::adopt( string url, string hash, Cache::Entry validators )
+{
+  // Points url at content that is already cached, if it is. Saves copying
+  // (and hashing) anything we have seen before.
+  string blob = Cache::blobPath( hash );
+  pthread_mutex_lock( &cacheLock );
+  bool present = boinc_file_exists( blob.c_str() );
+  if ( present )
+  {
+    double size = 0;
+    file_size( blob.c_str(), size );
+    useBlob( hash, size );
+
+    validators.hash = hash;
+    Cache::cacheIndex[ url ] = validators;
+    indexChanged();
+  }
+  pthread_mutex_unlock( &cacheLock );
+
+  return present;
+}
+
+bool Cache::restoreBytes( string url, string& data )
+{
+  Cache::Entry entry;
+  if ( ! Cache::lookup( url, entry ) )
+    return false;
+
+  FILE* source = fopen( Cache::blobPath( entry.hash ).c_str(), "rb" );
+  if ( source == NULL )
+    return false;
+
+  data.clear();
+  char buffer[ 16384 ];
+  size_t length;
+  while ( ( length = fread( buffer, 1, sizeof(buffer), source ) ) > 0 )
+    data.append( buffer, length );
+
+  bool readOk = ferror( source ) == 0;
+  fclose( source );
+  return readOk;
+}
+
+bool Cache::copyFile( FILE* source, FILE* destination )
+{
+  if ( source == NULL or destination == NULL )
+    return false;
+
+  char buffer[ 16384 ];
+  size_t length;
+  while ( ( length = fread( buffer, 1, sizeof(buffer), source ) ) > 0 )
+  {
+    if ( fwrite( buffer, 1, length, destination ) != length )
+      return false;
+  }
+
+  return ferror( source ) == 0;
+}
@@ -0,0 +1,62 @@
+#ifndef CACHE_H_INC
+#define CACHE_H_INC
+
+#include <string>
+#include <map>
+#include <cstddef>
+#include <stdint.h>
+
+// Persistent, content addressed download cache
+//
+// Every successful download is hashed and a copy kept under
+// ./dispFiles/cache/<hash>. An index (./dispFiles/cache/index.json) maps
+// each URL to the hash of its last known content along with the
+// validators the server sent for it, so later requests for the URL can be
+// made conditional and answered from the cache, across restarts and 
+// between configurations that share files.
+//
+// Blobs are hard linked with the copies in dispFiles where possible, so
+// nothing is stored twice, and the least recently used are evicted once
+// they add up to more than a limit. Changes to the index are written out
+// every few seconds at most, flush() writes any that are due.
+namespace Cache
+{
+  struct Entry
+  {
+    std::string hash;
+    std::string etag;
+    std::string lastModified;
+  };
+
+  typedef std::map< std::string, Entry > CacheIndex;
+
+  extern CacheIndex cacheIndex;
+
+  // 64 bit FNV-1a, which resources are hashed with too. A hash starts out
+  // as hashSeed and is updated with each piece of data in turn.
+  const uint64_t hashSeed = 0xcbf29ce484222325ULL;
+  void hashUpdate( uint64_t& hash, const void* data, size_t length );
+
+  std::string hashBytes( const char* data, size_t length );
+  std::string hashFile( std::string path );
+  std::string blobPath( std::string hash );
+
+  void load();
+  void save();
+  void flush();
+
+  bool lookup ( std::string url, Entry& entry );
+  bool store  ( std::string url, std::string localPath, Entry validators );
+  bool restore( std::string url, std::string localPath );
+
+  bool storeBytes  ( std::string url, const std::string& data, 
+                     Entry validators );
+  bool storeBytes  ( std::string url, const char* data, size_t length,
+                     Entry validators );
+  bool adopt       ( std::string url, std::string hash, Entry validators );
+  bool restoreBytes( std::string url, std::string& data );
+
+  bool copyFile( FILE* source, FILE* destination );
+};
+
+#endif //Include guard
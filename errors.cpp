@@ -1,6 +1,7 @@
 #include "errors.h"
 #include "objects.h"
 #include "graphics.h"
+#include "metrics.h"
 
 //BOINC
 #include "graphics2.h"
@@ -81,8 +82,9 @@ void Objects::DebugDisplay::render( double timestamp )
   // but principles of YNGNI suggest that someone should cross that bridge
   // when they come to it.
 
-  string displayText;
-  displayText = Errors::reverseByDelim( Errors::debugStream.str(), '\n' );
+  // Network statistics sit above the messages
+  string displayText = Metrics::summary() + "\n";
+  displayText += Errors::reverseByDelim( Errors::debugStream.str(), '\n' );
 
   if (self_coordType == Objects::NON_NORM)
     Graphics::drawText( displayText, (int)self_x, (int)self_y );
@@ -1,6 +1,8 @@
 #include "graphics.h"
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <string>
 using std::string;
@@ -123,14 +125,14 @@ bool Graphics::loadPng(string filename, int& outWidth, int& outHeight,
   if (imageInfo == NULL)
   {
     fclose(imageFile);
-    png_destroy_read_struct(&imageStruct, png_infopp_NULL, png_infopp_NULL);
+    png_destroy_read_struct(&imageStruct, NULL, NULL);
     return false;
   }
 
   //Error handling
   if (setjmp(png_jmpbuf(imageStruct)))
   {
-    png_destroy_read_struct(&imageStruct, &imageInfo, png_infopp_NULL);
+    png_destroy_read_struct(&imageStruct, &imageInfo, NULL);
     fclose(imageFile);
     return false;
   }
@@ -144,15 +146,16 @@ bool Graphics::loadPng(string filename, int& outWidth, int& outHeight,
   //Read the PNG into imageStruct!
   png_read_png(imageStruct, imageInfo, PNG_TRANSFORM_STRIP_16 | 
                PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, 
-               png_voidp_NULL);
+               NULL);
   //Passing back info as arguments
 
-  outWidth  = imageInfo->width;
-  outHeight = imageInfo->height;
+  outWidth  = png_get_image_width(imageStruct, imageInfo);
+  outHeight = png_get_image_height(imageStruct, imageInfo);
 
-  if (imageInfo->color_type == PNG_COLOR_TYPE_RGBA)
+  png_byte colourType = png_get_color_type(imageStruct, imageInfo);
+  if (colourType == PNG_COLOR_TYPE_RGBA)
     outHasAlpha = true;
-  else if (imageInfo->color_type == PNG_COLOR_TYPE_RGB)
+  else if (colourType == PNG_COLOR_TYPE_RGB)
     outHasAlpha = false;
   else
   {
@@ -175,12 +178,164 @@ bool Graphics::loadPng(string filename, int& outWidth, int& outHeight,
   }
 
   //Clean up
-  png_destroy_read_struct(&imageStruct, &imageInfo, png_infopp_NULL);
+  png_destroy_read_struct(&imageStruct, &imageInfo, NULL);
   fclose(imageFile);
   //And go home
   return true;
 }
 
+//Progressive PNG loading
+struct Graphics::PngStream
+{
+  png_structp imageStruct;
+  png_infop   imageInfo;
+
+  int      width;
+  int      height;
+  bool     hasAlpha;
+  size_t   bytesPerRow;
+  GLubyte* pixels;
+
+  bool     failed;
+  bool     finished;
+};
+
+void pngStreamInfo( png_structp imageStruct, png_infop imageInfo )
+{
+  // Called once the header is in. The transforms are loadPng()'s.
+  Graphics::PngStream* stream;
+  stream = (Graphics::PngStream*) png_get_progressive_ptr( imageStruct );
+
+  png_set_strip_16( imageStruct );
+  png_set_packing( imageStruct );
+  png_set_expand( imageStruct );
+  png_set_interlace_handling( imageStruct );
+  png_read_update_info( imageStruct, imageInfo );
+
+  int colourType = png_get_color_type( imageStruct, imageInfo );
+  if ( colourType != PNG_COLOR_TYPE_RGBA and 
+       colourType != PNG_COLOR_TYPE_RGB )
+    png_error( imageStruct, "Unsupported colour type" );
+
+  stream -> width       = png_get_image_width( imageStruct, imageInfo );
+  stream -> height      = png_get_image_height( imageStruct, imageInfo );
+  stream -> hasAlpha    = colourType == PNG_COLOR_TYPE_RGBA;
+  stream -> bytesPerRow = png_get_rowbytes( imageStruct, imageInfo );
+  stream -> pixels      = (GLubyte*) calloc( stream -> height, 
+                                             stream -> bytesPerRow );
+  if ( stream -> pixels == NULL )
+    png_error( imageStruct, "Out of memory" );
+}
+
+void pngStreamRow( png_structp imageStruct, png_bytep newRow, 
+                   png_uint_32 rowNumber, int pass )
+{
+  // Rows go straight to their place in the pixel buffer, bottom up.
+  // Interlaced images come in several passes, combined into what is there.
+  Graphics::PngStream* stream;
+  stream = (Graphics::PngStream*) png_get_progressive_ptr( imageStruct );
+  if ( newRow == NULL or (int) rowNumber >= stream -> height )
+    return;
+
+  size_t   rowFromBottom = stream -> height - 1 - rowNumber;
+  GLubyte* row = stream -> pixels + stream -> bytesPerRow * rowFromBottom;
+  png_progressive_combine_row( imageStruct, row, newRow );
+}
+
+void pngStreamEnd( png_structp imageStruct, png_infop imageInfo )
+{
+  Graphics::PngStream* stream;
+  stream = (Graphics::PngStream*) png_get_progressive_ptr( imageStruct );
+  stream -> finished = true;
+}
+
+void releasePngStream( Graphics::PngStream* stream )
+{
+  if ( stream -> imageStruct != NULL )
+    png_destroy_read_struct( &stream -> imageStruct, &stream -> imageInfo,
+                             NULL );
+  free( stream -> pixels );
+}
+
+Graphics::PngStream* Graphics::beginPng()
+{
+  Graphics::PngStream* stream = new Graphics::PngStream;
+  stream -> imageStruct = NULL;
+  stream -> pixels      = NULL;
+  Graphics::resetPng( stream );
+  return stream;
+}
+
+void Graphics::resetPng( Graphics::PngStream* stream )
+{
+  releasePngStream( stream );
+  stream -> imageStruct = NULL;
+  stream -> imageInfo   = NULL;
+  stream -> pixels      = NULL;
+  stream -> width       = 0;
+  stream -> height      = 0;
+  stream -> hasAlpha    = false;
+  stream -> bytesPerRow = 0;
+  stream -> failed      = true;
+  stream -> finished    = false;
+
+  stream -> imageStruct = png_create_read_struct( PNG_LIBPNG_VER_STRING,
+                                                  NULL, NULL, NULL );
+  if ( stream -> imageStruct == NULL )
+    return;
+
+  stream -> imageInfo = png_create_info_struct( stream -> imageStruct );
+  if ( stream -> imageInfo == NULL )
+    return;
+
+  png_set_progressive_read_fn( stream -> imageStruct, stream, 
+                               &pngStreamInfo, &pngStreamRow, 
+                               &pngStreamEnd );
+  stream -> failed = false;
+}
+
+void Graphics::feedPng( Graphics::PngStream* stream, const char* data,
+                        size_t size )
+{
+  // A bad image just stops decoding, whoever finishes the download falls
+  // back on loadPng() (which will say what was wrong)
+  if ( stream -> failed or stream -> finished )
+    return;
+
+  if ( setjmp( png_jmpbuf( stream -> imageStruct ) ) )
+  {
+    stream -> failed = true;
+    return;
+  }
+
+  png_process_data( stream -> imageStruct, stream -> imageInfo,
+                    (png_bytep) data, size );
+}
+
+bool Graphics::finishPng( Graphics::PngStream* stream, int& outWidth, 
+                          int& outHeight, bool& outHasAlpha, 
+                          GLubyte** outData )
+{
+  if ( stream -> failed or ! stream -> finished )
+    return false;
+
+  outWidth    = stream -> width;
+  outHeight   = stream -> height;
+  outHasAlpha = stream -> hasAlpha;
+  *outData    = stream -> pixels;
+  stream -> pixels = NULL;
+  return true;
+}
+
+void Graphics::endPng( Graphics::PngStream* stream )
+{
+  if ( stream == NULL )
+    return;
+
+  releasePngStream( stream );
+  delete stream;
+}
+
 
 //2D environment functions
 //(I do not know enough at time of writing to explain what these do, but the//do work)
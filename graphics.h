@@ -7,10 +7,17 @@
 //Standard
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <set>
 
 //OpenGL
 #include "boinc_gl.h"
 
+//Ours
+#include "networking.h"
+#include "resources.h"
+
 //The main namespace
 namespace Graphics
 {
@@ -20,6 +27,19 @@ namespace Graphics
 
   bool loadPng(std::string filename, int& outWidth, int& outHeight, 
                bool& outHasAlpha, GLubyte** outData);
+
+  // Progressive PNG decoding, for images fed in a chunk at a time as they
+  // download. Rows are decoded straight into the pixel buffer, laid out as
+  // loadPng() leaves it. resetPng() starts over (the download restarted),
+  // finishPng() hands over the pixels once the whole image has arrived.
+  struct PngStream;
+
+  PngStream* beginPng();
+  void       resetPng ( PngStream* stream );
+  void       feedPng  ( PngStream* stream, const char* data, size_t size );
+  bool       finishPng( PngStream* stream, int& outWidth, int& outHeight,
+                        bool& outHasAlpha, GLubyte** outData );
+  void       endPng   ( PngStream* stream );
   
   void drawableWindow( int& windowW, int& windowH );
   double screenAspect();
@@ -49,6 +69,7 @@ namespace Graphics
       ~Sprite();
   
       Sprite(std::string filename);
+      Sprite(int width, int height, bool hasAlpha, GLubyte* pixels);
       
       void blit( int    xScr, int    yScr, int    wScr, int    hScr,
                  double xTex, double yTex, double wTex, double hTex );
@@ -60,18 +81,93 @@ namespace Graphics
                     double xImg, double yImg, double wImg, double hImg);
 
       double aspectRatio(); //Width to height
+
+    private:
+      void upload(int width, int height, bool hasAlpha, GLubyte* pixels);
   };
 
   typedef std::map<std::string, Sprite*>     spriteGroup;
   typedef std::map<std::string, spriteGroup> spriteGroupMap;
 
+  // Sprite loading pipeline
+  //
+  // loadSprites() queues one asynchronous download per distinct file and
+  // returns straight away. PNGs are decoded as they arrive, anything that
+  // wasn't (a 304, or a cache hit) is decoded by a worker task, either way
+  // into DecodedSprites. processSprites() only uploads those, a few at a
+  // time from the render loop into pendingSprites. Once every sprite of
+  // the newest load is uploaded the pending set replaces the live one, so
+  // the old scene keeps drawing until then.
+  //
+  // Every Sprite in either set is held in the sprite cache, counted once
+  // for each name it goes by. Sprites made from a file are found again by
+  // its URL and the hash of its content, so a file used by several groups,
+  // or unchanged since it was last loaded, is only decoded and uploaded
+  // once. Sprites neither set refers to are deleted once a new set has
+  // gone live, so a reload can still reuse whatever the last one dropped.
+  // A group defined exactly as it was in the live set isn't loaded at all,
+  // its Sprites are carried over as they are - except for those made from
+  // files known to have changed on the server (by a manifest, say), which
+  // are fetched again on their own.
+  struct SpriteTarget
+  {
+    std::string groupName;
+    std::string spriteName;
+  };
+
+  struct SpriteLoad
+  {
+    std::string offsiteFilename;
+    std::string localFilename;
+    std::vector<SpriteTarget> targets;
+    unsigned int generation;
+    Networking::RequestId requestId;
+    PngStream* stream;
+  };
+
+  struct DecodedSprite
+  {
+    std::vector<SpriteTarget> targets;
+    std::string offsiteFilename;
+    std::string localFilename;
+    std::string hash;        // Of the file's content, as cached
+    unsigned int generation; // Of the load it's for
+    Sprite*  resident;       // Set if already in the sprite cache
+    bool     decoded;
+    int      width;
+    int      height;
+    bool     hasAlpha;
+    GLubyte* pixels;
+  };
+
+  struct CachedSprite
+  {
+    std::string key;         // URL and content hash, "" if not reusable
+    int         references;
+  };
+
+  typedef std::map<std::string, SpriteLoad*> SpriteLoadMap;
+  typedef std::deque<DecodedSprite>          DecodedSpriteQueue;
+  typedef std::map<Sprite*, CachedSprite>    SpriteCache;
+  typedef std::map<std::string, Sprite*>     SpriteCacheIndex;
+
   //Globals
   extern spriteGroupMap sprites;
+  extern spriteGroupMap pendingSprites;
 
-  void loadSprites(Json::Value);
+  void loadSprites(Json::Value, const Resources::ResourcesMap& resources,
+                   const std::set<std::string>& changedFiles);
+  bool processSprites();
+  bool spritesPending();
+  void spriteFiles(std::vector<std::string>& urls);
   void removeSprites();
+  void removeSprites(spriteGroupMap& groups);
   Sprite* getSprite(std::string spriteName);
   Sprite* getSprite(std::string groupName, std::string spriteName);
+  Sprite* placeholderSprite();
+
+  // Sprites of these groups are downloaded ahead of the rest
+  void prioritiseSprites(const std::set<std::string>& groups);
   
 }
 
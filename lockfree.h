@@ -0,0 +1,84 @@
+#ifndef LOCKFREE_H_INC
+#define LOCKFREE_H_INC
+
+#include <cstddef>
+
+namespace LockFree
+{
+  // Unbounded single producer, single consumer queue.
+  //
+  // Exactly one thread may push() and exactly one (other) thread may pop().
+  // It is a linked list that always keeps one already consumed node at 
+  // the head, so the producer and consumer never touch the same pointer:
+  // the producer only writes the last node's next, the consumer only moves
+  // the head. The barrier in push() makes sure a node is complete before 
+  // it becomes visible, the one in pop() that we read it after seeing it.
+  template< typename T >
+  class Queue
+  {
+    private:
+      struct Node
+      {
+        T              value;
+        Node* volatile next;
+      };
+
+      Node* self_head; // consumer's
+      Node* self_tail; // producer's
+
+      // Not copyable
+      Queue( const Queue& );
+      Queue& operator=( const Queue& );
+
+    public:
+      Queue()
+      {
+        self_head = new Node();
+        self_head -> next = NULL;
+        self_tail = self_head;
+      }
+
+      ~Queue()
+      {
+        while ( self_head != NULL )
+        {
+          Node* next = self_head -> next;
+          delete self_head;
+          self_head = next;
+        }
+      }
+
+      void push( const T& value )
+      {
+        Node* node = new Node();
+        node -> value = value;
+        node -> next  = NULL;
+
+        __sync_synchronize();
+        self_tail -> next = node;
+        self_tail = node;
+      }
+
+      bool pop( T& value )
+      {
+        Node* next = self_head -> next;
+        if ( next == NULL )
+          return false;
+
+        __sync_synchronize();
+        value = next -> value;
+
+        Node* consumed = self_head;
+        self_head = next;
+        delete consumed;
+        return true;
+      }
+
+      bool empty()
+      {
+        return self_head -> next == NULL;
+      }
+  };
+};
+
+#endif //Include guard
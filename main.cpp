@@ -20,6 +20,8 @@
 #include <cstdlib>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <set>
 
 using std::string;
 using std::ifstream;
@@ -37,6 +39,7 @@ using std::endl;
 #include "boinc_api.h"
 #include "boinc_gl.h" //This handles multiplatform openGL stuff
 #include "txf_util.h"
+#include "util.h"
 
 //Our stuff
 #include "graphics.h"
@@ -44,6 +47,10 @@ using std::endl;
 #include "boincShare.h"
 #include "resources.h"
 #include "networking.h"
+#include "tasks.h"
+#include "bundle.h"
+#include "manifest.h"
+#include "metrics.h"
 #include "errors.h"
 
 ///////////////////////////////////////////////////
@@ -60,118 +67,491 @@ double updatePeriod; //Defaults to 0
 
 string forcedConfigFile;
 Json::Value appConfig;
+Json::Value pendingConfig;
+Resources::Hash appConfigHash;     // Structural hashes of the two, so they
+Resources::Hash pendingConfigHash; // can be compared in one step
+
+// The next scene, built up whilst the current one carries on drawing.
+// It goes live in one go at a frame boundary, see publishScene().
+bool                    sceneStaged;
+Json::Value             stagedConfig;
+Resources::Hash         stagedConfigHash;
+Resources::ResourcesMap stagedResources;
+Resources::HashMap      stagedHashes;
+string      indexBuffer; // index.json is downloaded into memory
+bool        bundleLoading;
+string      manifestBuffer;
+bool        manifestLoading;
+std::set<string> changedFiles; // URLs known to have changed
+bool        freshnessLoading;
+double      freshnessCheckTime;          // When the sprite files were
+const double freshnessInterval = 300;    // last checked, and how often
+
+// Change notification. The server holds a request for settings.watch open
+// until something changes, so index.json is only fetched when it has.
+// Without an answer from the watch the refresh period is used instead.
+enum WatchState { WATCH_NONE, WATCH_STARTING, WATCH_ACTIVE, WATCH_FAILED };
+string      watchPath;
+string      watchBuffer;
+WatchState  watchState;
+bool        watchOutstanding;
+bool        changeNotified;
+double      watchRetryTime;
+const double watchRetryDelay = 60; // Before asking a server that can't
+long        watchHold = 30;         // Longest the server holds a watch,
+const long  watchHoldMargin = 10;   // and how much later it's given up on
+
+// A server that answers the watch straight away isn't holding it (a plain
+// file, say). Asked again at once it would cost a request every frame, so
+// there's a gap between asks, and a few quick answers in a row count as
+// a failure.
+double      watchSentTime;
+double      watchRearmTime;
+int         watchQuickAnswers;
+const double watchMinGap     = 2;
+const int    watchQuickLimit = 3;
+
+
+void prioritiseActiveView()
+{
+  // The sprites on show are downloaded ahead of the other views' 
+  if ( Objects::activeView != NULL )
+    Graphics::prioritiseSprites( 
+                       Objects::viewSpriteGroups( *Objects::activeView ) );
+}
 
-
-void updateConfiguration( CURL* indexHandle )
+void applySettings( const Json::Value& settings, 
+                    const Json::Value& previous )
 {
-  // Opens config file (default name "/index.json")
-  string indexFilename;
-  
-  // Check for forced configuration file from command line
-  if (forcedConfigFile != "")
+  // Each setting is only applied if it differs from the previous
+  // configuration's, so that changing the refresh period, say, doesn't
+  // start the server probing over
+  if ( settings["refresh"] != previous["refresh"] )
   {
-    Errors::dbg << "Using forced config file: " << forcedConfigFile << endl;
-    indexFilename = forcedConfigFile;
+    if ( settings["refresh"] . isNull() )
+    {
+      updatePeriod = 0;
+    }
+    else
+    {
+      if ( settings["refresh"].isNumeric() )
+        updatePeriod = settings["refresh"].asDouble(); //Global
+      else
+      {
+        Errors::err << "Nonsense refresh time" << endl 
+                    << "Choosing to not refresh" << endl;
+
+        updatePeriod = 0;
+      }
+    }
   }
-  else
+
+  // Connection limits, which default to something sensible for a VM
+  Json::Value connections = settings["connections"];
+  if ( connections != previous["connections"] )
   {
-    indexFilename = "./dispFiles/index.json";
+    Networking::ConnectionSettings connectionSettings;
+    if ( connections["total"].isNumeric() )
+      connectionSettings.maxTotal = connections["total"].asInt();
+    if ( connections["perHost"].isNumeric() )
+      connectionSettings.maxPerHost = connections["perHost"].asInt();
+    if ( connections["transfers"].isNumeric() )
+      connectionSettings.maxTransfers = connections["transfers"].asInt();
+    if ( connections["http2"].isBool() )
+      connectionSettings.multiplex = connections["http2"].asBool();
+    Networking::fileDownloader -> setConnections( connectionSettings );
   }
 
-  ifstream jsonFile( indexFilename.c_str() ); 
+  // Servers to fetch from, in order of preference. Without any the VM
+  // is used alone.
+  Json::Value serverList = settings["servers"];
+  if ( serverList != previous["servers"] )
+  {
+    Networking::ServerList servers;
+    for ( Json::Value::UInt i = 0; i < serverList.size(); i++ )
+    {
+      Networking::ServerSettings server;
+      if ( serverList[i].isString() )
+        server.address = serverList[i].asString();
+      else if ( serverList[i]["address"].isString() )
+      {
+        server.address = serverList[i]["address"].asString();
+        if ( serverList[i]["weight"].isNumeric() )
+          server.weight = serverList[i]["weight"].asDouble();
+      }
+
+      if ( server.address != "" )
+        servers.push_back( server );
+    }
+    Networking::fileDownloader -> setServers( servers );
+  }
 
-  if (!jsonFile)
+  // Somewhere to wait on for changes, rather than polling
+  string newWatch;
+  if ( settings["watch"].isString() )
+    newWatch = settings["watch"].asString();
+  if ( newWatch != watchPath )
   {
-    Errors::err << "Config file " << indexFilename << " not found." << endl
-                << "Keeping previous configuration";
-    return;
+    watchPath  = newWatch;
+    watchState = ( watchPath == "" ? WATCH_NONE : WATCH_STARTING );
+  }
+  if ( settings["watchHold"].isNumeric() )
+    watchHold = settings["watchHold"].asInt();
+}
+
+void publishScene()
+{
+  // Called between frames once the staged scene's sprites are live. The
+  // rest of it goes live at the same moment, so no frame ever draws half
+  // of one configuration and half of the next, and what the old scene
+  // alone used is gone before the next frame.
+  sceneStaged = false;
+  Resources::publish( stagedResources, stagedHashes );
+
+  // Usually only a little of a new configuration differs from the
+  // current one. Only that is replaced: objects defined exactly as before
+  // carry on as they are, as do settings that haven't changed.
+  if ( stagedConfigHash != appConfigHash )
+  {
+    const Json::Value& oldConfig = appConfig;
+    Objects::patchObjects( stagedConfig["objects"] );
+    applySettings( stagedConfig["settings"], oldConfig["settings"] );
+
+    appConfig     = stagedConfig;
+    appConfigHash = stagedConfigHash;
   }
 
+  // Let the objects see the new resources and sprites
+  Objects::updateObjects();
+  prioritiseActiveView();
 
-  //Parse config as Json
-  Json::Reader reader;
-  Json::Value newConfig;
-  bool parsingSuccessful = reader.parse(jsonFile, newConfig);
-  if (!parsingSuccessful)
+  stagedResources.clear();
+  stagedHashes.clear();
+  stagedConfig = Json::Value();
+
+  // The reload's sprites are in by now, so it ends here
+  Metrics::reloadFinished();
+}
+
+void applyConfiguration( Resources::ResourcesMap& newResources, 
+                         Resources::HashMap& newHashes, void* data )
+{
+  // Called once every resource of pendingConfig has been fetched and
+  // parsed. The scene is staged from it: the sprite groups that have
+  // changed are loaded, and once they have all arrived the render loop
+  // switches the whole scene over in publishScene().
+
+  // If neither the configuration nor the resources (all externalised
+  // things are resources) differ from the latest scene, nothing has
+  // changed. Both are compared by the hashes worked out when they were
+  // parsed.
+  Resources::Hash latestConfigHash = 
+                         sceneStaged ? stagedConfigHash : appConfigHash;
+  const Resources::HashMap& latestHashes = 
+                  sceneStaged ? stagedHashes : Resources::resourceHashes;
+  if ( pendingConfigHash == latestConfigHash and newHashes == latestHashes
+       and changedFiles.empty() )
   {
-    Errors::err << "Provided JSON file" << indexFilename 
-                << "is invalid JSON."   << endl
-                << "Keeping old configuration" << endl;
+    Metrics::reloadFinished();
     return;
   }
 
-  // Is this a new configuration or simply an update to the current one?
-  // If the two configurations are the same then there may be new images
-  if (appConfig == newConfig)
+  // A scene already staged is simply superseded
+  sceneStaged      = true;
+  stagedConfig     = pendingConfig;
+  stagedConfigHash = pendingConfigHash;
+  stagedResources  = newResources;
+  stagedHashes     = newHashes;
+
+  //Load the sprite groups that have changed, and the files (they replace
+  //the current sprites once they have all arrived)
+  Json::Value sprites = stagedConfig["sprites"];
+  Graphics::loadSprites( sprites, stagedResources, changedFiles );
+  changedFiles.clear();
+  prioritiseActiveView();
+
+  // Maybe one day a more intelligent solution can be employed as 
+  // a lot of file downloading/copying is taking place. This is currently
+  // because if you were to check the time of a file served from a VM it
+  // would be incorrect due to the pausing/resuming of the VM.
+}
+
+void bundleInstalled( bool installed, void* data )
+{
+  // With the bundle's files in the cache the resources (and sprites) they
+  // refer to mostly come straight from there
+  bundleLoading = false;
+  Resources::loadResources( pendingConfig["resources"], 
+                            &applyConfiguration, NULL );
+}
+
+void bundleDownloaded( CURL* bundleHandle, void* data )
+{
+  string bundleFilename = pendingConfig["settings"]["bundle"].asString();
+  Bundle::install( bundleFilename, &bundleInstalled, NULL );
+}
+
+void bundleUnchanged( CURL* bundleHandle, void* data )
+{
+  // Everything installed from it last time is still current
+  bundleInstalled( true, data );
+}
+
+void manifestDownloaded( CURL* manifestHandle, void* data )
+{
+  // Files the manifest lists with the hash they are cached under haven't
+  // changed, so are used as they are. Only the rest are asked for, and
+  // sprites made from them are loaded again even if nothing that refers
+  // to them has changed.
+  manifestLoading = false;
+
+  Manifest::Contents contents;
+  Manifest::Difference difference;
+  if ( Manifest::parse( manifestBuffer, contents ) )
   {
-    // If the resources also haven't changed then nothing has changed, so
-    // lets go check those ( all externalised things are resources ).
-    Resources::ResourcesMap newResources;
-    newResources = Resources::loadResources(newConfig["resources"]);
+    Manifest::compare( contents, difference );
+    Errors::dbg << "Manifest: " << difference.unchanged.size() 
+                << " unchanged, " << difference.changed.size() 
+                << " changed, " << difference.added.size() << " new"
+                << endl;
+
+    using Networking::fileDownloader;
+    std::vector<string> paths = difference.changed;
+    paths.insert( paths.end(), difference.added.begin(), 
+                  difference.added.end() );
+    for ( size_t i = 0; i < paths.size(); i++ )
+      changedFiles.insert( fileDownloader -> pathFromString( paths[i] ) );
+  }
+  else
+    Errors::err << "The manifest is invalid, fetching everything" << endl;
+
+  Networking::fileDownloader -> setFresh( difference.unchanged );
+  Resources::loadResources( pendingConfig["resources"], 
+                            &applyConfiguration, NULL );
+}
 
-    if (newResources != Resources::resourcesMap)
+void freshnessChecked( Networking::FreshnessList& results, void* data )
+{
+  // Sprite files the server now has something else for are loaded again,
+  // the rest are left be. They were asked for by URL.
+  freshnessLoading = false;
+
+  for ( size_t i = 0; i < results.size(); i++ )
+    if ( results[i].found and ! results[i].cached )
+      changedFiles.insert( results[i].filename );
+
+  Errors::dbg << "Freshness: " << changedFiles.size() << " of " 
+              << results.size() << " sprite files changed" << endl;
+  Resources::loadResources( pendingConfig["resources"], 
+                            &applyConfiguration, NULL );
+}
+
+void loadConfiguration( const Json::Value& config, Resources::Hash hash )
+{
+  // Fetch every resource the configuration refers to. They are all
+  // downloaded together and parsed off the render thread, the switch over
+  // happens in applyConfiguration() once the last one is ready. 
+  //
+  // A configuration can name a bundle in its settings, which carries all
+  // of its files in one transfer, or a manifest, which says which of them
+  // have changed. Either comes first. Without them the sprites' files are
+  // checked with a HEAD request each, as nothing else would notice one
+  // changing under an unchanged configuration.
+  pendingConfig     = config;
+  pendingConfigHash = hash;
+  changedFiles.clear();
+
+  Json::Value bundle   = config["settings"]["bundle"];
+  Json::Value manifest = config["settings"]["manifest"];
+  if ( ! bundle.isString() and manifest.isString() )
+  {
+    Networking::FileInformation manifestInfo;
+    manifestInfo . finishResponse = &manifestDownloaded;
+    manifestInfo . memorySink     = &manifestBuffer;
+    manifestInfo . priority       = Networking::CONTROL;
+    manifestBuffer . clear();
+    manifestLoading = true;
+    Networking::fileDownloader -> addFile( manifest.asString(), 
+                                           manifestInfo );
+    return;
+  }
+
+  if ( ! bundle.isString() )
+  {
+    std::vector<string> noFiles;
+    Networking::fileDownloader -> setFresh( noFiles );
+
+    // A configuration that keeps coming back unchanged doesn't need its
+    // sprites' files checked every time, every few minutes will do
+    std::vector<string> spriteFiles;
+    if ( dtime() - freshnessCheckTime >= freshnessInterval )
+      Graphics::spriteFiles( spriteFiles );
+    if ( spriteFiles.empty() )
+      Resources::loadResources( config["resources"], &applyConfiguration,
+                                NULL );
+    else
     {
-      // Resources have changed, so save the new resource node and go
-      // get the new sprites
-      Resources::resourcesMap = newResources;
+      freshnessLoading   = true;
+      freshnessCheckTime = dtime();
+      Networking::fileDownloader -> checkFreshness( spriteFiles, 
+                                                    &freshnessChecked, NULL,
+                                                    Networking::CONTROL );
+    }
+    return;
+  }
+
+  Networking::FileInformation bundleInfo;
+  bundleInfo . finishResponse    = &bundleDownloaded;
+  bundleInfo . unchangedResponse = &bundleUnchanged;
+  bundleInfo . priority          = Networking::CONTROL;
+  bundleLoading = true;
+  Networking::fileDownloader -> addFile( bundle.asString(), bundleInfo );
+}
+
+void updateConfiguration( CURL* indexHandle, void* data )
+{
+  // Parses the config, normally straight out of the index.json download
+  Json::Value newConfig;
+  bool parsingSuccessful;
+  string indexFilename;
+  
+  // Check for forced configuration file from command line
+  if (forcedConfigFile != "")
+  {
+    Errors::dbg << "Using forced config file: " << forcedConfigFile << endl;
+    indexFilename = forcedConfigFile;
 
-      Graphics::removeSprites();
-      Json::Value sprites = newConfig["sprites"];
-      Graphics::loadSprites(sprites);
+    ifstream jsonFile( indexFilename.c_str() ); 
 
-      Objects::updateObjects();
+    if (!jsonFile)
+    {
+      Errors::err << "Config file " << indexFilename << " not found." 
+                  << endl << "Keeping previous configuration";
+      return;
     }
 
-    // Maybe one day a more intelligent solution can be employed as 
-    // a lot of file downloading/copying is taking place. This is currently
-    // because if you were to check the time of a file served from a VM it
-    // would be incorrect due to the pausing/resuming of the VM.
+    Json::Reader reader;
+    parsingSuccessful = reader.parse(jsonFile, newConfig);
   }
   else
   {
-    // It's a new configuration, so remove the old and load the new
+    indexFilename = "/index.json";
+    parsingSuccessful = Resources::parseDocument(indexBuffer, newConfig);
+  }
 
-    /////////////
-    // LOADING //
-    /////////////
+  if (!parsingSuccessful)
+  {
+    Errors::err << "Provided JSON file " << indexFilename 
+                << " is invalid JSON."   << endl
+                << "Keeping old configuration" << endl;
+    return;
+  }
 
-    //Load the resources (automatic removal upon assignment)
-    Json::Value resources = newConfig["resources"];
-    Resources::resourcesMap = Resources::loadResources(resources);
+  loadConfiguration( newConfig, Resources::hashValue( newConfig ) );
+}
 
+void configurationUnchanged( CURL* indexHandle, void* data )
+{
+  // index.json hasn't changed since we last read it, so there is no need
+  // to parse it again. The resources it refers to may have though, so
+  // check those (conditionally, so unchanged ones cost very little).
+  if (forcedConfigFile != "")
+  {
+    updateConfiguration( indexHandle, data );
+    return;
+  }
 
-    //Find the sprites and load them
-    Graphics::removeSprites();
-    Json::Value sprites = newConfig["sprites"];
-    Graphics::loadSprites(sprites);
+  if ( sceneStaged )
+    loadConfiguration( stagedConfig, stagedConfigHash );
+  else
+    loadConfiguration( appConfig, appConfigHash );
+}
 
+void watchAnswered( CURL* watchHandle, void* data )
+{
+  // A 200 means something changed, a 304 that the server stopped holding
+  // on without anything having. The first answer only says where things
+  // stand (the configuration is being fetched anyway). Anything else, no
+  // answer in time or answers that come back without being held, and the
+  // server can't do this (or has hung), so it's back to polling for a
+  // while.
+  watchOutstanding = false;
+  double now     = dtime();
+  double heldFor = now - watchSentTime;
+  watchRearmTime = now + watchMinGap;
+
+  long responseCode = 0;
+  if ( watchHandle != NULL )
+    curl_easy_getinfo( watchHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+
+  // The first answer is always quick, so isn't counted
+  if ( watchState == WATCH_ACTIVE and heldFor < watchHold / 2.0 )
+    watchQuickAnswers++;
+  else
+    watchQuickAnswers = 0;
 
-    //Load the new objects
-    Objects::removeObjects();
-    Json::Value objects = newConfig["objects"];
-    Objects::loadObjects(objects);
+  if ( ( responseCode != 200 and responseCode != 304 ) or 
+       watchQuickAnswers >= watchQuickLimit )
+  {
+    if ( watchState != WATCH_FAILED )
+      Errors::dbg << "No change notification from " << watchPath 
+                  << ", polling instead" << endl;
+    watchState        = WATCH_FAILED;
+    watchRetryTime    = reportedTime + watchRetryDelay;
+    watchQuickAnswers = 0;
+    return;
+  }
 
-    // General settings/sanity checks
-    if ( newConfig["settings"]["refresh"] . isNull() )
-    {
-      updatePeriod = 0;
-    }
-    else
-    {
-      if ( newConfig["settings"]["refresh"].isNumeric() )
-        updatePeriod = newConfig["settings"]["refresh"].asDouble(); //Global
-      else
-      {
-        Errors::err << "Nonsense refresh time" << endl 
-                    << "Choosing to not refresh" << endl;
+  if ( responseCode == 200 and watchState == WATCH_ACTIVE )
+    changeNotified = true;
+  watchState = WATCH_ACTIVE;
+}
 
-        updatePeriod = 0;
-      }
-    }
+void watchConfiguration()
+{
+  // Keeps a request waiting on the server. It asks with the ETag of the
+  // last answer (the cache sends it), which the server holds on to until
+  // its files no longer match.
+  if ( watchPath == "" or watchOutstanding or forcedConfigFile != "" )
+    return;
+  if ( watchState == WATCH_FAILED and reportedTime < watchRetryTime )
+    return;
+  if ( dtime() < watchRearmTime )
+    return;
 
-    // Accept the new configuration
-    appConfig = newConfig;
-  }
+  Networking::FileInformation watchInfo;
+  watchInfo . finishResponse = &watchAnswered;
+  watchInfo . memorySink     = &watchBuffer;
+  watchInfo . priority       = Networking::CONTROL;
+  watchInfo . longPoll       = true;
+  watchInfo . maxTime        = watchHold + watchHoldMargin;
+  watchBuffer . clear();
+  watchOutstanding = true;
+  watchSentTime    = dtime();
+  Networking::fileDownloader -> addFile( watchPath, watchInfo );
+}
+
+bool requestConfiguration()
+{
+  using Networking::fileDownloader;
+
+  // Don't start another round whilst the last one's resources (or the
+  // sprites of the scene it staged) are still coming in
+  if ( fileDownloader->isInQueue("/index.json") or 
+       bundleLoading or manifestLoading or freshnessLoading or 
+       Resources::loading() or sceneStaged )
+    return false;
+
+  using Networking::FileInformation;
+  FileInformation indexInfo;
+  indexInfo . finishResponse    = &updateConfiguration;
+  indexInfo . unchangedResponse = &configurationUnchanged;
+  indexInfo . memorySink        = &indexBuffer;
+  indexInfo . priority          = Networking::CONTROL;
+  indexBuffer . clear();
+  fileDownloader->addFile("/index.json", indexInfo);
+  Metrics::reloadStarted();
+  return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -199,22 +579,33 @@ void app_graphics_render(int xs, int ys, double timestamp)
   // CURL Downloading 
   Networking::fileDownloader -> process();
 
-  // Updates every "updatePeriod" seconds
-  if ( reportedTime - timeOfUpdate > updatePeriod )
+  // Finish off any background work (resource parsing)
+  Tasks::process();
+
+  // Sprite uploading. A staged scene goes live once its sprites have,
+  // otherwise objects are just updated when a new set does.
+  bool spritesSwapped = Graphics::processSprites();
+  if ( sceneStaged and ! Graphics::spritesPending() )
+    publishScene();
+  else if ( spritesSwapped )
+    Objects::updateObjects();
+
+  // Changes are waited on if the configuration says where
+  watchConfiguration();
+  if ( changeNotified and requestConfiguration() )
+  {
+    changeNotified = false;
+    timeOfUpdate   = reportedTime;
+  }
+
+  // Otherwise updates every "updatePeriod" seconds
+  if ( watchState != WATCH_ACTIVE and 
+       reportedTime - timeOfUpdate > updatePeriod )
   {
     // Only update if the updatePeriod is > 0 or it's the first time
     if ( updatePeriod > 0 or ( updatePeriod == 0 and appConfig.isNull() ) )
     {
-      using Networking::fileDownloader;
-      
-      if ( ! fileDownloader->isInQueue("/index.json") )
-      {
-        using Networking::FileInformation;
-        FileInformation indexInfo;
-        indexInfo . finishResponse = &updateConfiguration;
-        fileDownloader->addFile("/index.json", indexInfo);
-      }
-
+      requestConfiguration();
       timeOfUpdate = reportedTime;
     }
   }
@@ -319,7 +710,10 @@ void boinc_app_key_press(int key, int)
     size_t viewNumber = key - 49;
 
     if ( viewNumber < Objects::viewList.size() )
+    {
       Objects::activeView = & Objects::viewList . at ( viewNumber );
+      prioritiseActiveView();
+    }
 
   }
   // Pausing ( global variable )
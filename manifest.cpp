@@ -0,0 +1,56 @@
+//Our stuff
+#include "manifest.h"
+#include "networking.h"
+#include "cache.h"
+
+//JsonCpp
+#include "json/json.h"
+
+//Std
+#include <string>
+#include <vector>
+#include <map>
+
+using std::string;
+
+bool Manifest::parse( const string& buffer, Manifest::Contents& contents )
+{
+  Json::Value manifest;
+  Json::Reader reader;
+  if ( ! reader.parse( buffer, manifest, false ) or ! manifest.isObject() )
+    return false;
+
+  contents.clear();
+  for ( Json::ValueIterator itr = manifest.begin(); 
+        itr != manifest.end(); itr++ )
+  {
+    if ( ! (*itr).isString() )
+      return false;
+    contents[ itr.key().asString() ] = (*itr).asString();
+  }
+
+  return true;
+}
+
+void Manifest::compare( const Manifest::Contents& contents, 
+                        Manifest::Difference& difference )
+{
+  // The cache is keyed on the full URL, as the downloader asks for it
+  difference.unchanged.clear();
+  difference.changed.clear();
+  difference.added.clear();
+
+  for ( Manifest::Contents::const_iterator itr = contents.begin();
+        itr != contents.end(); itr++ )
+  {
+    string url = Networking::fileDownloader -> pathFromString( itr->first );
+
+    Cache::Entry entry;
+    if ( ! Cache::lookup( url, entry ) )
+      difference.added.push_back( itr -> first );
+    else if ( entry.hash == itr -> second )
+      difference.unchanged.push_back( itr -> first );
+    else
+      difference.changed.push_back( itr -> first );
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef MANIFEST_H_INC
+#define MANIFEST_H_INC
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Asset manifests - what the server has, without fetching any of it
+//
+// A manifest is a JSON object from each file's path on the server to its
+// hash (as Cache::hashBytes()):
+//
+//   { "/event.png" : "8a1f0c2d9e3b4a57", "/histogram.png" : "..." }
+//
+// TestServe/mkmanifest.py makes them. Comparing one with the cache tells
+// which files have changed since they were last fetched, and the rest can
+// be used as they are without a request each (see 
+// FileDownloader::setFresh()).
+namespace Manifest
+{
+  typedef std::map< std::string, std::string > Contents;
+
+  struct Difference
+  {
+    std::vector< std::string > unchanged;  // Cached with the same hash
+    std::vector< std::string > changed;    // Cached with another hash
+    std::vector< std::string > added;      // Not cached at all
+  };
+
+  bool parse( const std::string& buffer, Contents& contents );
+  void compare( const Contents& contents, Difference& difference );
+};
+
+#endif //Include guard
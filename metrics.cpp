@@ -0,0 +1,234 @@
+//Our stuff
+#include "metrics.h"
+
+//BOINC
+#include "filesys.h"
+#include "util.h"
+
+//JsonCpp
+#include "json/json.h"
+
+//Standard
+#include <string>
+#include <deque>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+using std::string;
+using std::deque;
+using std::stringstream;
+using std::ofstream;
+using std::endl;
+
+const string statsFile = "./dispFiles/netstats.json";
+
+// How much history the aggregates cover
+const size_t sampleWindowSize = 256;
+const size_t reloadWindowSize = 32;
+
+Metrics::SampleWindow samples;
+Metrics::ReloadWindow reloads;
+
+// Running totals, for the whole session
+unsigned long transfersSeen = 0;
+unsigned long cacheHits     = 0;
+double        bytesSeen     = 0;
+
+// The debug view asks for the summary every frame, so it is only worked
+// out again once something has changed
+string summaryText;
+bool   summaryStale = true;
+
+// The reload under way, if any
+bool   reloadActive    = false;
+double reloadStartTime = 0;
+Metrics::Reload currentReload;
+
+void Metrics::record( const Metrics::Sample& sample )
+{
+  samples.push_back( sample );
+  if ( samples.size() > sampleWindowSize )
+    samples.pop_front();
+
+  summaryStale = true;
+  transfersSeen++;
+  bytesSeen += sample.bytes;
+  if ( sample.cacheHit )
+    cacheHits++;
+
+  if ( reloadActive )
+  {
+    currentReload.bytes += sample.bytes;
+    currentReload.transfers++;
+  }
+}
+
+void Metrics::reloadStarted()
+{
+  reloadActive            = true;
+  reloadStartTime         = dtime();
+  currentReload.bytes     = 0;
+  currentReload.duration  = 0;
+  currentReload.transfers = 0;
+}
+
+void Metrics::reloadFinished()
+{
+  if ( ! reloadActive )
+    return;
+
+  reloadActive = false;
+  summaryStale = true;
+  currentReload.duration = dtime() - reloadStartTime;
+  reloads.push_back( currentReload );
+  if ( reloads.size() > reloadWindowSize )
+    reloads.pop_front();
+
+  Metrics::save();
+}
+
+bool Metrics::lastReload( Metrics::Reload& reload )
+{
+  if ( reloads.empty() )
+    return false;
+
+  reload = reloads.back();
+  return true;
+}
+
+double Metrics::percentile( deque<double> values, double fraction )
+{
+  // Nearest rank, so p50 of two values is the lower one
+  if ( values.empty() )
+    return 0;
+
+  std::sort( values.begin(), values.end() );
+  size_t rank = (size_t)( fraction * ( values.size() - 1 ) + 0.5 );
+  return values[ rank ];
+}
+
+// The timings of the window's samples, as one series per measure
+struct Series
+{
+  deque<double> dns;
+  deque<double> connect;
+  deque<double> firstByte;
+  deque<double> total;
+  deque<double> throughput;
+};
+
+Series collectSeries()
+{
+  // Files answered straight from the cache never went near the network,
+  // so they'd only flatter the timings
+  Series series;
+  for ( size_t i = 0; i < samples.size(); i++ )
+  {
+    const Metrics::Sample& sample = samples[i];
+    if ( sample.cacheHit and sample.responseCode == 0 )
+      continue;
+
+    series.dns.push_back( sample.dnsTime );
+    series.connect.push_back( sample.connectTime );
+    series.firstByte.push_back( sample.firstByteTime );
+    series.total.push_back( sample.totalTime );
+    if ( sample.bytes > 0 )
+      series.throughput.push_back( sample.throughput );
+  }
+
+  return series;
+}
+
+Json::Value describe( const deque<double>& values )
+{
+  Json::Value description;
+  description["p50"] = Metrics::percentile( values, 0.5 );
+  description["p99"] = Metrics::percentile( values, 0.99 );
+  return description;
+}
+
+Json::Value statistics()
+{
+  Series series = collectSeries();
+
+  Json::Value stats;
+  stats["transfers"]     = (double) transfersSeen;
+  stats["cacheHits"]     = (double) cacheHits;
+  stats["bytes"]         = bytesSeen;
+  stats["dnsTime"]       = describe( series.dns );
+  stats["connectTime"]   = describe( series.connect );
+  stats["firstByteTime"] = describe( series.firstByte );
+  stats["totalTime"]     = describe( series.total );
+  stats["throughput"]    = describe( series.throughput );
+
+  int retried = 0;
+  for ( size_t i = 0; i < samples.size(); i++ )
+    if ( samples[i].attempts > 0 )
+      retried++;
+  stats["retriedTransfers"] = retried;
+
+  deque<double> reloadBytes;
+  deque<double> reloadTimes;
+  for ( size_t i = 0; i < reloads.size(); i++ )
+  {
+    reloadBytes.push_back( reloads[i].bytes );
+    reloadTimes.push_back( reloads[i].duration );
+  }
+  stats["reloadBytes"] = describe( reloadBytes );
+  stats["reloadTime"]  = describe( reloadTimes );
+
+  if ( ! reloads.empty() )
+  {
+    stats["lastReload"]["bytes"]     = reloads.back().bytes;
+    stats["lastReload"]["duration"]  = reloads.back().duration;
+    stats["lastReload"]["transfers"] = reloads.back().transfers;
+  }
+
+  return stats;
+}
+
+string Metrics::summary()
+{
+  if ( ! summaryStale )
+    return summaryText;
+
+  Json::Value stats = statistics();
+
+  double hitRate = 0;
+  if ( transfersSeen > 0 )
+    hitRate = 100.0 * cacheHits / transfersSeen;
+
+  stringstream text;
+  text.precision( 3 );
+  text << "Network: " << transfersSeen << " transfers, "
+       << bytesSeen / 1024 << " KiB, " << hitRate << "% cached, "
+       << stats["retriedTransfers"].asInt() << " retried" << endl
+       << "  first byte p50/p99: "
+       << stats["firstByteTime"]["p50"].asDouble() * 1000 << "/"
+       << stats["firstByteTime"]["p99"].asDouble() * 1000 << " ms" << endl
+       << "  total p50/p99: "
+       << stats["totalTime"]["p50"].asDouble() * 1000 << "/"
+       << stats["totalTime"]["p99"].asDouble() * 1000 << " ms" << endl
+       << "  throughput p50: "
+       << stats["throughput"]["p50"].asDouble() / 1024 << " KiB/s" << endl
+       << "  reload p50: " 
+       << stats["reloadBytes"]["p50"].asDouble() / 1024 << " KiB in " 
+       << stats["reloadTime"]["p50"].asDouble() << " s" << endl;
+
+  summaryText  = text.str();
+  summaryStale = false;
+  return summaryText;
+}
+
+void Metrics::save()
+{
+  // Written aside and moved into place, so a reader never sees half a file
+  string partFile = statsFile + ".part";
+  ofstream stats( partFile.c_str() );
+  Json::StyledWriter writer;
+  stats << writer.write( statistics() );
+  stats.close();
+
+  boinc_rename( partFile.c_str(), statsFile.c_str() );
+}
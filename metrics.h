@@ -0,0 +1,54 @@
+#ifndef METRICS_H_INC
+#define METRICS_H_INC
+
+#include <string>
+#include <deque>
+
+// Network telemetry
+//
+// FileDownloader::process() records a Sample for every finished transfer.
+// The most recent samples are kept for aggregates (percentiles of the
+// timings, throughput, cache hit rate), along with the bytes and time each
+// configuration reload took. summary() is shown in the debug view, and
+// save() writes the same as JSON to ./dispFiles/netstats.json for anything
+// that wants to collect it.
+namespace Metrics
+{
+  struct Sample
+  {
+    std::string url;
+    long        responseCode;
+    double      dnsTime;       // All times in seconds from the start
+    double      connectTime;
+    double      firstByteTime;
+    double      totalTime;
+    double      bytes;
+    double      throughput;    // Bytes per second
+    int         attempts;
+    bool        cacheHit;      // 304, or answered from the cache
+  };
+
+  struct Reload
+  {
+    double bytes;
+    double duration;
+    int    transfers;
+  };
+
+  typedef std::deque< Sample > SampleWindow;
+  typedef std::deque< Reload > ReloadWindow;
+
+  void record( const Sample& sample );
+
+  // Bracket a configuration reload, so its cost can be totalled up
+  void reloadStarted();
+  void reloadFinished();
+  bool lastReload( Reload& reload );
+
+  double percentile( std::deque<double> values, double fraction );
+
+  std::string summary();
+  void save();
+};
+
+#endif //Include guard
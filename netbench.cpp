@@ -0,0 +1,367 @@
+////////////////////////////////////////////////////////////////////////////
+// netbench - download benchmark
+//
+// Two modes, both run against a server such as TestServe/mockserver:
+//
+//   ./netbench reload [server] [rounds]
+//
+// Reloads the configuration as the screensaver does - index.json, the
+// resources it names, then every sprite file - and reports how long each
+// reload took and its throughput.
+//
+//   ./netbench bundle [server] [bundle] [rounds]
+//
+// Times fetching the files of a bundle one request each, as the
+// screensaver does without one, against fetching the bundle itself (run
+// TestServe/mkbundle.py over the served directory first).
+//
+// The server can be a comma separated list, the first being the default
+// server and the rest mirrors (see FileDownloader::setServers()), which
+// is how failover can be tried out with several mockservers.
+//
+// Each round is timed cold (nothing cached) and warm (everything cached,
+// so only revalidated), first over HTTP/1.1 (pipelined, if libcurl is old
+// enough to still do so) and then over HTTP/2. The server has to speak 
+// HTTP/2 for the second to mean anything, e.g. nghttpd or h2o over the
+// same files.
+////////////////////////////////////////////////////////////////////////////
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <set>
+#include <iostream>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+
+//cURL
+#include <curl/curl.h>
+
+//BOINC
+#include "util.h"
+
+//Our stuff
+#include "boincShare.h"
+#include "networking.h"
+#include "tasks.h"
+#include "cache.h"
+#include "bundle.h"
+#include "resources.h"
+#include "metrics.h"
+#include "errors.h"
+
+// The screensaver's objects are linked in, so these need to exist
+Share::SharedData* Share::data;
+
+void app_graphics_render(int xs, int ys, double timestamp) {}
+void app_graphics_resize(int width, int height) {}
+void app_graphics_init() {}
+void boinc_app_mouse_move(int x, int y, int left, int middle, int right){}
+void boinc_app_mouse_button(int x, int y, int which, int is_down){}
+void boinc_app_key_press(int key, int){}
+void boinc_app_key_release(int, int){}
+
+int outstanding;
+
+void fileFinished( CURL* easyHandle, void* data )
+{
+  delete (string*) data;
+  outstanding--;
+}
+
+void bundleFinished( bool installed, void* data )
+{
+  outstanding--;
+}
+
+void bundleCurrent( CURL* easyHandle, void* data )
+{
+  outstanding--;
+}
+
+void bundleFetched( CURL* easyHandle, void* data )
+{
+  string* bundleFilename = (string*) data;
+  Bundle::install( *bundleFilename, &bundleFinished, NULL );
+}
+
+void waitForOutstanding()
+{
+  while ( outstanding > 0 )
+  {
+    Networking::fileDownloader -> process();
+    Tasks::process();
+    boinc_sleep( 0.001 );
+  }
+}
+
+double fetchFiles( const vector<string>& files )
+{
+  double start = dtime();
+
+  // Without a bundle, nothing is known to be fresh
+  vector<string> noFiles;
+  Networking::fileDownloader -> setFresh( noFiles );
+
+  outstanding = files.size();
+  for ( size_t i = 0; i < files.size(); i++ )
+  {
+    string* buffer = new string;
+    Networking::FileInformation info;
+    info . finishResponse    = &fileFinished;
+    info . unchangedResponse = &fileFinished;
+    info . memorySink        = buffer;
+    info . userData          = buffer;
+    Networking::fileDownloader -> addFile( files[i], info );
+  }
+  waitForOutstanding();
+
+  return dtime() - start;
+}
+
+double fetchBundle( string& bundleFilename )
+{
+  double start = dtime();
+
+  // The bundle is installed, which costs the unpacking too
+  Networking::FileInformation info;
+  info . finishResponse    = &bundleFetched;
+  info . unchangedResponse = &bundleCurrent;
+  info . userData          = &bundleFilename;
+  outstanding = 1;
+  Networking::fileDownloader -> addFile( bundleFilename, info );
+  waitForOutstanding();
+
+  return dtime() - start;
+}
+
+// The reload path
+string      indexBuffer;
+Json::Value reloadConfig;
+
+void spriteFetched( CURL* easyHandle, void* data )
+{
+  outstanding--;
+}
+
+void resourcesLoaded( Resources::ResourcesMap& newResources, 
+                      Resources::HashMap& newHashes, void* data )
+{
+  // As Graphics::loadSprites(), less the decoding and uploading
+  Resources::publish( newResources, newHashes );
+
+  Json::Value sprites = reloadConfig["sprites"];
+  if ( sprites["external"].isBool() and sprites["external"].asBool() )
+    sprites = Resources::getResourceNode( sprites["resource"].asString(),
+                                          sprites["node"].asString() );
+
+  std::set<string> files;
+  for ( Json::ValueIterator group = sprites.begin(); 
+        group != sprites.end(); group++ )
+  {
+    for ( Json::Value::UInt i = 0; i < (*group).size(); i++ )
+    {
+      Json::Value sprite = (*group)[i];
+      if ( sprite.isString() )
+        files.insert( sprite.asString() );
+      else if ( sprite.isObject() )
+        files.insert( sprite["file"].asString() );
+    }
+  }
+
+  for ( std::set<string>::iterator file = files.begin(); 
+        file != files.end(); file++ )
+  {
+    Networking::FileInformation info;
+    info . finishResponse    = &spriteFetched;
+    info . unchangedResponse = &spriteFetched;
+    outstanding++;
+    Networking::fileDownloader -> addFile( *file, info );
+  }
+
+  outstanding--;
+}
+
+void indexFetched( CURL* easyHandle, void* data )
+{
+  if ( ! Resources::parseDocument( indexBuffer, reloadConfig ) )
+  {
+    cout << "index.json is invalid JSON" << endl;
+    outstanding--;
+    return;
+  }
+
+  // Resources are still outstanding until resourcesLoaded()
+  Resources::loadResources( reloadConfig["resources"], &resourcesLoaded,
+                            NULL );
+}
+
+Metrics::Reload reload()
+{
+  Metrics::reloadStarted();
+
+  Networking::FileInformation indexInfo;
+  indexInfo . finishResponse = &indexFetched;
+  indexInfo . memorySink     = &indexBuffer;
+  indexInfo . priority       = Networking::CONTROL;
+  indexBuffer . clear();
+
+  outstanding = 1;
+  Networking::fileDownloader -> addFile( "/index.json", indexInfo );
+  waitForOutstanding();
+
+  Metrics::reloadFinished();
+
+  Metrics::Reload finished;
+  Metrics::lastReload( finished );
+  return finished;
+}
+
+void forgetCache()
+{
+  // The network thread is idle between rounds
+  Cache::cacheIndex.clear();
+  Cache::save();
+}
+
+void printReload( const Metrics::Reload& reload )
+{
+  double throughput = 0;
+  if ( reload.duration > 0 )
+    throughput = reload.bytes / reload.duration / 1024;
+
+  cout << reload.transfers << "\t" << reload.duration << "\t" 
+       << reload.bytes / 1024 << "\t" << throughput;
+}
+
+int benchmarkReload( int rounds )
+{
+  cout << "protocol\tcold transfers\tcold s\tcold KiB\tcold KiB/s\t"
+       << "warm transfers\twarm s\twarm KiB\twarm KiB/s" << endl;
+
+  for ( int run = 0; run < 2 * rounds; run++ )
+  {
+    Networking::ConnectionSettings settings;
+    settings.multiplex = run >= rounds;
+    Networking::fileDownloader -> setConnections( settings );
+
+    forgetCache();
+    Metrics::Reload cold = reload();
+    Metrics::Reload warm = reload();
+
+    cout << ( settings.multiplex ? "HTTP/2" : "HTTP/1.1" ) << "\t";
+    printReload( cold );
+    cout << "\t";
+    printReload( warm );
+    cout << endl;
+  }
+
+  return 0;
+}
+
+int benchmarkBundle( string bundleFilename, int rounds )
+{
+  // The bundle's table of contents says which files to fetch singly
+  string localBundle = Networking::fileDownloader -> getFile(
+                                                        bundleFilename );
+  Bundle::Archive archive;
+  if ( ! Bundle::open( localBundle, archive ) )
+  {
+    cout << "Couldn't fetch the bundle " << bundleFilename << endl;
+    return 1;
+  }
+
+  vector<string> files;
+  for ( size_t i = 0; i < archive.contents.size(); i++ )
+    files.push_back( archive.contents[i].path );
+  Bundle::close( archive );
+
+  cout << "protocol\tfiles\tcold files\tcold bundle\twarm files\t"
+       << "warm bundle" << endl;
+
+  for ( int run = 0; run < 2 * rounds; run++ )
+  {
+    Networking::ConnectionSettings settings;
+    settings.multiplex = run >= rounds;
+    Networking::fileDownloader -> setConnections( settings );
+
+    forgetCache();
+    double coldFiles  = fetchFiles( files );
+    double warmFiles  = fetchFiles( files );
+
+    forgetCache();
+    double coldBundle = fetchBundle( bundleFilename );
+    double warmBundle = fetchBundle( bundleFilename );
+
+    cout << ( settings.multiplex ? "HTTP/2" : "HTTP/1.1" ) << "\t"
+         << files.size() << "\t" << coldFiles << "\t" << coldBundle
+         << "\t" << warmFiles << "\t" << warmBundle << endl;
+  }
+
+  return 0;
+}
+
+int main( int argc, char** argv )
+{
+  string mode           = "reload";
+  string server         = "http://localhost:7859";
+  string bundleFilename = "/bundle.cvmb";
+  int    rounds         = 5;
+
+  if ( argc > 1 ) mode   = argv[1];
+  if ( argc > 2 ) server = argv[2];
+
+  if ( mode == "bundle" )
+  {
+    if ( argc > 3 ) bundleFilename = argv[3];
+    if ( argc > 4 ) rounds         = atoi( argv[4] );
+  }
+  else if ( mode == "reload" )
+  {
+    if ( argc > 3 ) rounds = atoi( argv[3] );
+  }
+  else
+  {
+    cout << "Usage: netbench reload [server] [rounds]" << endl
+         << "       netbench bundle [server] [bundle] [rounds]" << endl;
+    return 1;
+  }
+
+  Networking::ServerList servers;
+  size_t start = 0;
+  while ( start <= server.size() )
+  {
+    size_t comma = server.find( ',', start );
+    if ( comma == string::npos )
+      comma = server.size();
+
+    Networking::ServerSettings mirror;
+    mirror.address = server.substr( start, comma - start );
+    if ( mirror.address != "" )
+      servers.push_back( mirror );
+    start = comma + 1;
+  }
+
+  if ( servers.empty() )
+  {
+    cout << "No server given" << endl;
+    return 1;
+  }
+
+  Networking::fileDownloader = new Networking::FileDownloader( 
+                                                  servers[0].address );
+  Networking::fileDownloader -> setServers( servers );
+
+  int result;
+  if ( mode == "bundle" )
+    result = benchmarkBundle( bundleFilename, rounds );
+  else
+    result = benchmarkReload( rounds );
+
+  delete Networking::fileDownloader;
+  return result;
+}
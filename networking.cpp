@@ -1,21 +1,66 @@
 //boinc
 #include "filesys.h"
+#include "util.h"
 
 //cURL
 #include <curl/curl.h>
 
 //Ours
 #include "networking.h"
+#include "cache.h"
+#include "metrics.h"
 #include "errors.h"
 
 // Standard
 #include <string>
+#include <vector>
+#include <sstream>
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+//pthreads
+#include <pthread.h>
+
 using std::string;
+using std::stringstream;
+using std::vector;
 using std::endl;
 
 Networking::FileDownloader* Networking::fileDownloader;
 
+// Idle easy handles beyond this are cleaned up rather than pooled
+const size_t maxPooledHandles = 16;
+
+// Connection limits until a configuration says otherwise
+const long defaultMaxConnections        = 8;
+const long defaultMaxHostConnections    = 4;
+const long defaultMaxTransfers          = 8;
+
+// Retry backoff, in seconds
+const double retryBaseDelay = 0.5;
+const double retryMaxDelay  = 60.0;
+
+// A transfer slower than this many bytes a second for stallTime seconds
+// (a paused VM, a suspended task) is given up on, and resumed later
+const long stallSpeed = 1;
+const long stallTime  = 30;
+
+// Background server probes, in seconds. Healthy servers are probed every
+// serverProbeInterval, those that failed back off as retries do. Each 
+// probe time counts for latencySmoothing of the smoothed latency.
+const double serverProbeInterval = 10.0;
+const long   serverProbeTimeout  = 5;
+const double latencySmoothing    = 0.3;
+
+// Longest the network thread sleeps for when there is nothing to do, in
+// milliseconds. Only matters if curl_multi_wakeup() is unavailable.
+#if LIBCURL_VERSION_NUM >= 0x074400
+const int idlePollTimeout = 1000;
+#else
+const int idlePollTimeout = 50;
+#endif
+
 #ifdef __unix__
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,7 +80,101 @@ time_t Networking::fileModifyTime( string localPath )
 
 
 Networking::FileInformation::FileInformation() :
-  filep(NULL), modTime(-1) {}
+  finishResponse(NULL), unchangedResponse(NULL), userData(NULL), 
+  filep(NULL), modTime(-1), 
+  attempts(0), priority(Networking::ACTIVE), headers(NULL), 
+  resumeFrom(0), memorySink(NULL), streamFunc(NULL), streamData(NULL),
+  status(0), freshness(NULL), longPoll(false), maxTime(0) {}
+
+Networking::ServerSettings::ServerSettings() :
+  weight(1) {}
+
+bool Networking::cacheable( const Networking::FileInformation& info )
+{
+  // Downloads into a caller's own FILE* can't be cached, as we don't know
+  // where they end up.
+  return info . localPath != "" or info . memorySink != NULL;
+}
+
+size_t appendToMemory( char* data, size_t size, size_t count, void* sink )
+{
+  std::string* buffer = (std::string*) sink;
+  buffer -> append( data, size * count );
+  return size * count;
+}
+
+size_t writeAndStream( char* data, size_t size, size_t count, void* file )
+{
+  // Writes to the download's file as libcurl would, and passes the same on
+  // to its chunkFunc
+  Networking::FileInformation* info = (Networking::FileInformation*) file;
+  size_t written = fwrite( data, size, count, info -> filep );
+
+  if ( info -> status == 200 or info -> status == 206 )
+    (*info -> streamFunc)( data, size * count, info -> streamData );
+
+  return written * size;
+}
+
+size_t headerReceived( char* buffer, size_t size, size_t count, void* data )
+{
+  // Picks the cache validators out of the response headers
+  Networking::FileInformation* info = (Networking::FileInformation*) data;
+  size_t length = size * count;
+  string header( buffer, length );
+
+  // A new status line means a new response (redirects and the like), so 
+  // forget anything from the previous one
+  if ( header.compare( 0, 5, "HTTP/" ) == 0 )
+  {
+    info -> etag = "";
+    info -> lastModified = "";
+
+    size_t space = header.find( ' ' );
+    info -> status = 0;
+    if ( space != string::npos )
+      info -> status = atol( header.c_str() + space + 1 );
+    return length;
+  }
+
+  size_t colon = header.find( ':' );
+  if ( colon == string::npos )
+    return length;
+
+  string name  = header.substr( 0, colon );
+  string value = header.substr( colon + 1 );
+
+  // Trim the value, headers end in CRLF
+  size_t start = value.find_first_not_of( " \t" );
+  size_t end   = value.find_last_not_of( " \t\r\n" );
+  if ( start == string::npos )
+    value = "";
+  else
+    value = value.substr( start, end - start + 1 );
+
+  if ( strcasecmp( name.c_str(), "ETag" ) == 0 )
+    info -> etag = value;
+  else if ( strcasecmp( name.c_str(), "Last-Modified" ) == 0 )
+    info -> lastModified = value;
+
+  return length;
+}
+
+double Networking::retryDelay( int attempts )
+{
+  // Exponential backoff capped at retryMaxDelay. Half of the delay is 
+  // random, so that many requests failing together don't all come back
+  // together.
+  double delay = retryBaseDelay;
+  for ( int i = 1; i < attempts and delay < retryMaxDelay; i++ )
+    delay *= 2;
+
+  if ( delay > retryMaxDelay )
+    delay = retryMaxDelay;
+
+  double jitter = double( rand() ) / RAND_MAX;
+  return delay * ( 0.5 + 0.5 * jitter );
+}
 
 string Networking::FileDownloader::pathFromString(string path)
 {
@@ -59,15 +198,19 @@ string Networking::FileDownloader::getFile(string filename)
 
   string newFilename; 
 
-  CURL* downloadHandle = curl_easy_init();
+  CURL* downloadHandle = this -> acquireHandle();
   if (downloadHandle)
   {
-    newFilename = "./dispFiles/" + filename;
-    FILE* newFile = fopen(newFilename.c_str(), "w");
-
     string offsitePath = this->pathFromString(filename);
+    Networking::FileInformation fileInfo;
+    fileInfo . filePath  = offsitePath;
+    this -> openDownload( filename, fileInfo );
+    newFilename = fileInfo . localPath;
+
     curl_easy_setopt(downloadHandle, CURLOPT_URL, offsitePath.c_str());
-    curl_easy_setopt(downloadHandle, CURLOPT_WRITEDATA, newFile);
+    curl_easy_setopt(downloadHandle, CURLOPT_WRITEDATA, fileInfo . filep);
+    this -> prepareCaching( downloadHandle, fileInfo );
+
     CURLcode result = curl_easy_perform(downloadHandle);
 
     if (result != CURLE_OK) 
@@ -80,175 +223,1568 @@ string Networking::FileDownloader::getFile(string filename)
       Errors::dbg << "Successful file download of " << offsitePath << endl;
     }
 
-    fclose(newFile);
+    fclose( fileInfo . filep );
+
+    if (result == CURLE_OK)
+      this -> completeDownload( downloadHandle, fileInfo );
+
+    curl_slist_free_all( fileInfo . headers );
   }
 
-  curl_easy_cleanup(downloadHandle);
+  this -> releaseHandle(downloadHandle);
 
   return newFilename;
 }
 
+void* Networking::networkThread( void* downloader )
+{
+  ((Networking::FileDownloader*) downloader) -> run();
+  return NULL;
+}
+
+void Networking::lockShare( CURL* easyHandle, curl_lock_data data, 
+                            curl_lock_access access, void* downloader )
+{
+  Networking::FileDownloader* owner;
+  owner = (Networking::FileDownloader*) downloader;
+  pthread_mutex_lock( &( owner -> self_shareLocks[ data ] ) );
+}
+
+void Networking::unlockShare( CURL* easyHandle, curl_lock_data data, 
+                              void* downloader )
+{
+  Networking::FileDownloader* owner;
+  owner = (Networking::FileDownloader*) downloader;
+  pthread_mutex_unlock( &( owner -> self_shareLocks[ data ] ) );
+}
+
+Networking::ConnectionSettings::ConnectionSettings() :
+  maxTotal( defaultMaxConnections ), 
+  maxPerHost( defaultMaxHostConnections ), 
+  maxTransfers( defaultMaxTransfers ), multiplex( true )
+{
+}
+
 Networking::FileDownloader::FileDownloader(string defaultServerAddress) :
-  self_numActive(0), self_multiHandle(NULL)
+  self_multiHandle(NULL), self_nextRequestId(1), self_requestsActive(0),
+  self_running(false), self_threaded(false), self_settingsChanged(true), 
+  self_serversChanged(true), self_share(NULL), 
+  self_poolHits(0), 
+  self_poolMisses(0), self_serverUnreachable(false), 
+  self_probeFailures(0), self_nextProbe(0), self_probeId(0)
 {
   self_multiHandle = curl_multi_init();
+
+  // Handles in the multi already share a connection cache, the share
+  // object extends that (and DNS/TLS caching) to synchronous transfers.
+  // Both threads use it, hence the locking.
+  for ( int i = 0; i < CURL_LOCK_DATA_LAST; i++ )
+    pthread_mutex_init( &self_shareLocks[i], NULL );
+  pthread_mutex_init( &self_poolLock, NULL );
+  pthread_mutex_init( &self_deliveredLock, NULL );
+  pthread_mutex_init( &self_settingsLock, NULL );
+
+  self_share = curl_share_init();
+  curl_share_setopt( self_share, CURLSHOPT_LOCKFUNC, &lockShare );
+  curl_share_setopt( self_share, CURLSHOPT_UNLOCKFUNC, &unlockShare );
+  curl_share_setopt( self_share, CURLSHOPT_USERDATA, this );
+  curl_share_setopt( self_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+  curl_share_setopt( self_share, CURLSHOPT_SHARE, 
+                     CURL_LOCK_DATA_SSL_SESSION );
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt( self_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT );
+#endif
+
   self_defaultServerAddress = defaultServerAddress;
+  self_pendingServers.resize( 1 );
+  self_pendingServers[0].address = defaultServerAddress;
   boinc_mkdir("./dispFiles");
+  Cache::load();
+
+  // Without a thread of its own the multi handle is driven from process()
+  // instead, a step per frame, so downloads still happen - just slower.
+  self_thread   = pthread_self();
+  self_running  = true;
+  self_threaded = 
+    pthread_create( &self_thread, NULL, &networkThread, this ) == 0;
+  if ( ! self_threaded )
+  {
+    Errors::err << "Unable to start the network thread, downloads will "
+                << "run on the render thread" << endl;
+    self_thread = pthread_self();
+  }
 }
 
-long Networking::FileDownloader::getFileAge( string filename )
+Networking::FileDownloader::~FileDownloader()
 {
-  string onlineFilePath = this -> pathFromString( filename );
+  self_running = false;
+  if ( self_threaded )
+  {
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup( self_multiHandle );
+#endif
+    pthread_join( self_thread, NULL );
+  }
 
-  CURL* easyHandle = curl_easy_init();
-  curl_easy_setopt( easyHandle, CURLOPT_URL, onlineFilePath.c_str());
-  curl_easy_setopt( easyHandle, CURLOPT_NOBODY, 1);
-  curl_easy_setopt( easyHandle, CURLOPT_FILETIME, 1);
+  // Only this thread is left now. Anything unfinished is dropped, easy 
+  // handles go before the multi and the share they were attached to.
+  Networking::TransferTable::iterator itr;
+  for ( itr = self_transfers.begin(); itr != self_transfers.end(); itr++ )
+    this -> discardTransfer( itr -> second );
+  self_transfers.clear();
+  self_waitingQueue.clear();
+  self_runningQueue.clear();
+  self_retries.clear();
 
-  CURLcode result =  curl_easy_perform( easyHandle );
-  if (result == CURLE_OK)
+  Networking::Transfer* transfer;
+  while ( self_submitted.pop( transfer ) )
+    this -> discardTransfer( transfer );
+  while ( self_completed.pop( transfer ) )
+    this -> discardTransfer( transfer );
+  while ( ! self_answered.empty() )
   {
-    long age = -1;
-    curl_easy_getinfo(easyHandle, CURLINFO_FILETIME, &age);
+    this -> discardTransfer( self_answered.front() );
+    self_answered.pop_front();
+  }
 
-    if (age == -1)
-      Errors::err << "ERROR - the server does not support file ages." 
-                  << endl;
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+  {
+    if ( self_servers[i].probeHandle == NULL )
+      continue;
+    curl_multi_remove_handle( self_multiHandle, 
+                              self_servers[i].probeHandle );
+    curl_easy_cleanup( self_servers[i].probeHandle );
+  }
 
-    return age;
+  for ( size_t i = 0; i < self_handlePool.size(); i++ )
+    curl_easy_cleanup( self_handlePool[i] );
+  self_handlePool.clear();
+
+  curl_multi_cleanup( self_multiHandle );
+  curl_share_cleanup( self_share );
+  Cache::save();
+
+  for ( int i = 0; i < CURL_LOCK_DATA_LAST; i++ )
+    pthread_mutex_destroy( &self_shareLocks[i] );
+  pthread_mutex_destroy( &self_poolLock );
+  pthread_mutex_destroy( &self_deliveredLock );
+  pthread_mutex_destroy( &self_settingsLock );
+}
+
+void Networking::FileDownloader::discardTransfer( 
+                                           Networking::Transfer* transfer )
+{
+  // Shutting down - no finish response, the caller's gone too
+  if ( transfer -> easyHandle != NULL )
+  {
+    curl_multi_remove_handle( self_multiHandle, transfer -> easyHandle );
+    curl_easy_cleanup( transfer -> easyHandle );
   }
-  else
+  if ( transfer -> info . filep != NULL )
+    fclose( transfer -> info . filep );
+  curl_slist_free_all( transfer -> info . headers );
+  delete transfer;
+}
+
+string weakEtag( const string& etag )
+{
+  // The ETag less any W/ prefix
+  if ( etag.compare( 0, 2, "W/" ) == 0 )
+    return etag.substr( 2 );
+  return etag;
+}
+
+void freshnessAnswered( CURL* easyHandle, void* data )
+{
+  // Finish response of every check in a batch, the last one to answer 
+  // hands the batch back
+  Networking::FreshnessCheck* check = (Networking::FreshnessCheck*) data;
+  if ( --(check -> pending) > 0 )
+    return;
+
+  (*check -> done)( check -> results, check -> userData );
+  delete check;
+}
+
+void Networking::FileDownloader::checkFreshness( 
+                                 const vector<string>& filenames,
+                                 Networking::freshnessFunc done,
+                                 void* userData,
+                                 Networking::Priority priority )
+{
+  // Render thread. The results are sized up front, so each request can
+  // be pointed at its own slot.
+  Networking::FreshnessCheck* check = new Networking::FreshnessCheck;
+  check -> results.resize( filenames.size() );
+  check -> pending  = filenames.size();
+  check -> done     = done;
+  check -> userData = userData;
+
+  if ( filenames.empty() )
+  {
+    freshnessAnswered( NULL, check );
+    return;
+  }
+
+  for ( size_t i = 0; i < filenames.size(); i++ )
+  {
+    Networking::Freshness& result = check -> results[i];
+    result.filename = filenames[i];
+    result.found    = false;
+    result.modTime  = -1;
+    result.cached   = false;
+
+    Networking::FileInformation info;
+    info . finishResponse = &freshnessAnswered;
+    info . userData       = check;
+    info . priority       = priority;
+    info . freshness      = &result;
+    this -> addFile( filenames[i], info );
+  }
+}
+
+void Networking::FileDownloader::answerFreshness( 
+                                           Networking::Transfer* transfer )
+{
+  // Render thread - fills in a freshness check's result from the response
+  // headers, and compares them with the cache
+  Networking::FileInformation& info = transfer -> info;
+  Networking::Freshness& result = *(info . freshness);
+
+  Cache::Entry entry;
+  bool isCached = Cache::lookup( info . filePath, entry );
+
+  // Answered without a request, as the file is known to be fresh
+  if ( transfer -> easyHandle == NULL )
   {
-    //An error occured, file probably inaccessible
-    return -1;
+    result.found        = isCached;
+    result.cached       = isCached;
+    result.etag         = entry.etag;
+    result.lastModified = entry.lastModified;
+    if ( entry.lastModified != "" )
+      result.modTime = curl_getdate( entry.lastModified.c_str(), NULL );
+    return;
   }
+
+  long responseCode = 0;
+  long modTime = -1;
+  curl_easy_getinfo( transfer -> easyHandle, CURLINFO_RESPONSE_CODE,
+                     &responseCode );
+  curl_easy_getinfo( transfer -> easyHandle, CURLINFO_FILETIME, &modTime );
+
+  result.found        = ( responseCode >= 200 and responseCode < 300 ) or
+                        responseCode == 304;
+  result.modTime      = modTime;
+  result.etag         = info . etag;
+  result.lastModified = info . lastModified;
+
+  // ETags decide it (compared weakly - it's whether the file changed,
+  // not whether its bytes can be spliced), otherwise the date has to do.
+  // With neither to go on there's no sign of a change, and taking every
+  // such file as changed would have them all fetched again every time.
+  if ( ! result.found or ! isCached )
+    result.cached = false;
+  else if ( responseCode == 304 )
+    result.cached = true;
+  else if ( info . etag != "" and entry.etag != "" )
+    result.cached = weakEtag( info . etag ) == weakEtag( entry.etag );
+  else if ( info . lastModified != "" and entry.lastModified != "" )
+    result.cached = info . lastModified == entry.lastModified;
+  else
+    result.cached = true;
 }
 
-void Networking::FileDownloader::addFile(string filename,  
+Networking::RequestId Networking::FileDownloader::addFile(string filename,
                                        Networking::FileInformation fileInfo)
 {
-  //XXX
-  //The current implimentation stores the information against the
-  //easy_handle in a map. I've deemed this a bad (but currently unavoidable)
-  //choice. This is because we technically lose track of the easy_handle,
-  //only being able to get back at it through the multi_handle. So the
-  //only thing we can guarantee is that there will be an easy handle passed
-  //back at completion, but the pointer value (which we are using as the map
-  //key) may well change - hence a bad decision.
-  //HOWEVER, I've hopefully written the abstraction in such a way that this
-  //doesn't affect the "user", so changing this implimentation should not be
-  //too much of an issue in future.
-
+  // Render thread - the transfer is set up and started by the network
+  // thread, this only hands it over.
   string onlineFilePath = this->pathFromString(filename);
   fileInfo . filePath = onlineFilePath;
 
-  //Allow the user to choose a different place to put the file if necessary
-  if (fileInfo . filep == NULL)
-  {  
-    string localPath = "./dispFiles/" + filename;
-    fileInfo . filep = fopen( localPath.c_str(), "w" );
+  Networking::Transfer* transfer = new Networking::Transfer;
+  transfer -> id         = self_nextRequestId++;
+  transfer -> filename   = filename;
+  transfer -> info       = fileInfo;
+  transfer -> easyHandle = NULL;
+  transfer -> unchanged  = false;
+  transfer -> state      = Networking::WAITING;
+  transfer -> server     = -1;
+
+  self_queuedPaths[ onlineFilePath ]++;
+  self_requestsActive++;
+
+  if ( this -> answerFromCache( transfer ) )
+    return transfer -> id;
+
+  self_submitted.push( transfer );
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup( self_multiHandle );
+#endif
+
+  return transfer -> id;
+}
+
+bool Networking::FileDownloader::answerFromCache( 
+                                           Networking::Transfer* transfer )
+{
+  // Render thread - a fresh file needs no request at all, it is answered
+  // straight from the cache on the next process().
+  Networking::FileInformation& info = transfer -> info;
+  if ( self_fresh.find( info . filePath ) == self_fresh.end() )
+    return false;
+
+  if ( info . freshness != NULL )
+  {
+    self_answered.push_back( transfer );
+    return true;
   }
 
-  //Make and setup the easyHandle
-  CURL* easyHandle = curl_easy_init();
-  curl_easy_setopt(easyHandle, CURLOPT_URL, onlineFilePath.c_str());
-  curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, fileInfo . filep);
+  if ( info . filep != NULL or ! Networking::cacheable( info ) )
+    return false;
 
-  curl_easy_setopt( easyHandle, CURLOPT_FILETIME, 1);
-  if (fileInfo.modTime != -1)
+  if ( info . memorySink == NULL )
+    info . localPath = "./dispFiles/" + transfer -> filename;
+
+  transfer -> unchanged = this -> deliverCached( info );
+  self_answered.push_back( transfer );
+  return true;
+}
+
+void Networking::FileDownloader::setFresh( 
+                                       const vector<string>& filenames )
+{
+  // Replaces the set of files whose cached copies can be used as they are
+  self_fresh.clear();
+  for ( size_t i = 0; i < filenames.size(); i++ )
+    self_fresh.insert( this -> pathFromString( filenames[i] ) );
+}
+
+bool Networking::FileDownloader::isInQueue( string filename )
+{
+  // Requests are indexed by online path, so turn filename into one.
+  string onlinePath = this -> pathFromString( filename );
+
+  return self_queuedPaths.find( onlinePath ) != self_queuedPaths.end();
+}
+
+Networking::RequestId Networking::FileDownloader::requestIdOf( 
+                                                         CURL* easyHandle )
+{
+  char* privateData = NULL;
+  curl_easy_getinfo( easyHandle, CURLINFO_PRIVATE, &privateData );
+  return (Networking::RequestId) privateData;
+}
+
+void Networking::FileDownloader::report( bool isError, 
+                                         const stringstream& message )
+{
+  // The Errors streams belong to the render thread, so messages from the
+  // network thread are queued up for process() to pass on.
+  if ( ! self_threaded or ! pthread_equal( pthread_self(), self_thread ) )
+  {
+    if ( isError )
+      Errors::err << message.str() << endl;
+    else
+      Errors::dbg << message.str() << endl;
+    return;
+  }
+
+  Networking::LogMessage logMessage;
+  logMessage.isError = isError;
+  logMessage.text    = message.str();
+  self_log.push( logMessage );
+}
+
+void Networking::FileDownloader::openDownload( string filename,
+                                    Networking::FileInformation& info )
+{
+  // The body is written aside, so the current local copy survives both a
+  // 304 and a failed transfer.
+  info . localPath = "./dispFiles/" + filename;
+  info . partPath  = info . localPath + ".part";
+  info . filep     = fopen( info . partPath.c_str(), "wb" );
+}
+
+void Networking::FileDownloader::prepareCaching( CURL* easyHandle,
+                                    Networking::FileInformation& info )
+{
+  // Collect validators from the response, and if we have the URL cached
+  // already, make the request conditional on it having changed.
+  curl_easy_setopt( easyHandle, CURLOPT_HEADERFUNCTION, &headerReceived );
+  curl_easy_setopt( easyHandle, CURLOPT_HEADERDATA, &info );
+  curl_easy_setopt( easyHandle, CURLOPT_FILETIME, 1 );
+
+  Cache::Entry entry;
+  if ( Networking::cacheable( info ) and 
+       Cache::lookup( info . filePath, entry ) )
   {
-    curl_easy_setopt( easyHandle, CURLOPT_TIMEVALUE, fileInfo.modTime);
+    if ( entry.etag != "" )
+    {
+      string header = "If-None-Match: " + entry.etag;
+      info . headers = curl_slist_append( info . headers, header.c_str() );
+      curl_easy_setopt( easyHandle, CURLOPT_HTTPHEADER, info . headers );
+    }
+
+    if ( entry.lastModified != "" and info . modTime == -1 )
+      info . modTime = curl_getdate( entry.lastModified.c_str(), NULL );
+  }
+
+  if ( info . modTime != -1 )
+  {
+    long modTime = info . modTime;
+    curl_easy_setopt( easyHandle, CURLOPT_TIMEVALUE, modTime );
     curl_easy_setopt( easyHandle, CURLOPT_TIMECONDITION,
-                      CURL_TIMECOND_IFMODSINCE);
+                      CURL_TIMECOND_IFMODSINCE );
+  }
+}
+
+bool Networking::FileDownloader::completeDownload( CURL* easyHandle,
+                                    Networking::FileInformation& info )
+{
+  // Called once a transfer has succeeded and its file is closed. Moves the
+  // new body into place (and into the cache), or on a 304 makes sure the 
+  // local copy is the cached one. Returns true if the content is the same 
+  // as was last handed to a finish response.
+  if ( ! Networking::cacheable( info ) )
+    return false;
+
+  long responseCode = 0;
+  curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+
+  // A 206 is the rest of a resumed download, so the file is whole
+  if ( responseCode == 200 or responseCode == 206 )
+  {
+    if ( info . memorySink == NULL )
+      boinc_rename( info . partPath.c_str(), info . localPath.c_str() );
+
+    Cache::Entry validators;
+    validators.etag         = info . etag;
+    validators.lastModified = info . lastModified;
+
+    bool stored = false;
+    if ( info . memorySink != NULL )
+      stored = Cache::storeBytes( info . filePath, *(info . memorySink),
+                                  validators );
+    else
+      stored = Cache::store( info . filePath, info . localPath, 
+                             validators );
+
+    Cache::Entry entry;
+    pthread_mutex_lock( &self_deliveredLock );
+    if ( stored and Cache::lookup( info . filePath, entry ) )
+      self_delivered[ info . filePath ] = entry.hash;
+    else
+      self_delivered.erase( info . filePath );
+    pthread_mutex_unlock( &self_deliveredLock );
+
+    return false;
+  }
+
+  // Anything else is an error page rather than the file, which mustn't
+  // replace the local copy
+  if ( responseCode != 304 )
+  {
+    if ( info . memorySink == NULL )
+      boinc_delete_file( info . partPath.c_str() );
+    return false;
   }
 
-  //Save the information
-  self_fileInfos[easyHandle] = fileInfo;
-  
-  //Add the easy to the multi!
-  curl_multi_add_handle(self_multiHandle, easyHandle);
+  // Not modified - nothing arrived, so the local copy is left alone
+  if ( info . memorySink == NULL )
+    boinc_delete_file( info . partPath.c_str() );
 
-  self_numActive++;
+  stringstream message;
+  message << "Not modified: \"" << info . filePath << "\"";
+  this -> report( false, message );
+
+  return this -> deliverCached( info );
 }
 
-bool Networking::FileDownloader::isInQueue( string filename )
+bool Networking::FileDownloader::deliverCached( 
+                                    Networking::FileInformation& info )
 {
-  // Fileinfo structs store by online filename, so turn filename into an
-  // online path.
+  // Hands over the cached copy of a file known to be current. Returns true
+  // if it is what was last handed to a finish response.
+  Cache::Entry entry;
+  if ( ! Cache::lookup( info . filePath, entry ) )
+  {
+    stringstream error;
+    error << "\"" << info . filePath << "\" is unchanged, "
+          << "but it isn't cached";
+    this -> report( true, error );
+    return false;
+  }
 
-  string onlinePath = this -> pathFromString( filename );
+  pthread_mutex_lock( &self_deliveredLock );
+  Networking::DeliveryMap::iterator delivered;
+  delivered = self_delivered.find( info . filePath );
+  bool unchanged = delivered != self_delivered.end() and 
+                   delivered -> second == entry.hash;
+  pthread_mutex_unlock( &self_deliveredLock );
+
+  // If the caller can make do with being told nothing changed, then
+  // there's no need to produce the content again
+  if ( unchanged and info . unchangedResponse != NULL )
+    return true;
+
+  bool restored = true;
+  if ( info . memorySink != NULL )
+    restored = Cache::restoreBytes( info . filePath, *(info . memorySink) );
 
-  for ( FileInfoMap::iterator itr  = self_fileInfos.begin();
-                              itr != self_fileInfos.end();
-                              itr ++ )
+  // Only fall back on the cached copy if the local one isn't it (a new
+  // session, or another config used the same name)
+  else if ( Cache::hashFile( info . localPath ) != entry.hash )
+    restored = Cache::restore( info . filePath, info . localPath );
+
+  if ( ! restored )
   {
-    if (itr -> second . filePath == onlinePath)
-      return true;
+    stringstream error;
+    error << "Unable to restore \"" << info . filePath 
+          << "\" from the cache";
+    this -> report( true, error );
+  }
+
+  pthread_mutex_lock( &self_deliveredLock );
+  self_delivered[ info . filePath ] = entry.hash;
+  pthread_mutex_unlock( &self_deliveredLock );
+  return unchanged;
+}
+
+bool Networking::FileDownloader::prepareResume( CURL* easyHandle,
+                                    Networking::FileInformation& info,
+                                    CURLcode result )
+{
+  // Called when a download to a part file has failed. If the server can
+  // be trusted to send the rest of the same body the retry carries on 
+  // from the end of the part file, with If-Range so a changed file comes
+  // back whole. Otherwise the part file is emptied and the retry starts 
+  // again from scratch, as an ordinary conditional request. Returns true
+  // if the retry resumes.
+  if ( info . partPath == "" or info . filep == NULL )
+    return false;
+
+  // The validators are those of the response that failed (if there was
+  // one), and a weak ETag says nothing about the bytes
+  long responseCode = 0;
+  curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+  if ( responseCode == 200 or responseCode == 206 )
+  {
+    info . resumeValidator = info . etag;
+    if ( info . etag == "" or info . etag.compare( 0, 2, "W/" ) == 0 )
+      info . resumeValidator = info . lastModified;
+  }
+  else if ( responseCode != 0 )
+    info . resumeValidator = "";
+
+  fflush( info . filep );
+  long onDisk = ftell( info . filep );
+
+  curl_slist_free_all( info . headers );
+  info . headers = NULL;
+  curl_easy_setopt( easyHandle, CURLOPT_HTTPHEADER, NULL );
+
+  if ( result != CURLE_RANGE_ERROR and onDisk > 0 and 
+       info . resumeValidator != "" )
+  {
+    // Whatever the cache holds is older than the body being resumed, so
+    // the request is no longer conditional on it
+    info . resumeFrom = onDisk;
+    string header = "If-Range: " + info . resumeValidator;
+    info . headers = curl_slist_append( info . headers, header.c_str() );
+    curl_easy_setopt( easyHandle, CURLOPT_HTTPHEADER, info . headers );
+    curl_easy_setopt( easyHandle, CURLOPT_TIMECONDITION, 
+                      CURL_TIMECOND_NONE );
+    curl_easy_setopt( easyHandle, CURLOPT_RESUME_FROM_LARGE, 
+                      (curl_off_t) onDisk );
+    return true;
   }
 
+  fclose( info . filep );
+  info . filep           = fopen( info . partPath.c_str(), "wb" );
+  info . resumeFrom      = 0;
+  info . resumeValidator = "";
+  if ( info . streamFunc != NULL )
+    (*info . streamFunc)( NULL, 0, info . streamData );
+  else
+    curl_easy_setopt( easyHandle, CURLOPT_WRITEDATA, info . filep );
+  curl_easy_setopt( easyHandle, CURLOPT_RESUME_FROM_LARGE, 
+                    (curl_off_t) 0 );
+  this -> prepareCaching( easyHandle, info );
   return false;
 }
 
-void Networking::FileDownloader::process()
+CURL* Networking::FileDownloader::acquireHandle()
+{
+  // Hands out a clean easy handle attached to the share, reusing a pooled
+  // one where possible.
+  CURL* easyHandle = NULL;
+
+  pthread_mutex_lock( &self_poolLock );
+  if ( self_handlePool.empty() )
+    self_poolMisses++;
+  else
+  {
+    easyHandle = self_handlePool.back();
+    self_handlePool.pop_back();
+    self_poolHits++;
+  }
+  pthread_mutex_unlock( &self_poolLock );
+
+  if ( easyHandle == NULL )
+    easyHandle = curl_easy_init();
+  else
+    curl_easy_reset( easyHandle );
+
+  if ( easyHandle != NULL )
+    curl_easy_setopt( easyHandle, CURLOPT_SHARE, self_share );
+
+  return easyHandle;
+}
+
+void Networking::FileDownloader::releaseHandle( CURL* easyHandle )
+{
+  if ( easyHandle == NULL )
+    return;
+
+  pthread_mutex_lock( &self_poolLock );
+  bool pooled = self_handlePool.size() < maxPooledHandles;
+  if ( pooled )
+    self_handlePool.push_back( easyHandle );
+  pthread_mutex_unlock( &self_poolLock );
+
+  if ( ! pooled )
+    curl_easy_cleanup( easyHandle );
+}
+
+string Networking::FileDownloader::poolReport()
+{
+  pthread_mutex_lock( &self_poolLock );
+  unsigned long hits  = self_poolHits;
+  unsigned long total = self_poolHits + self_poolMisses;
+  size_t        idle  = self_handlePool.size();
+  pthread_mutex_unlock( &self_poolLock );
+
+  double hitRate = 0;
+  if ( total > 0 )
+    hitRate = 100.0 * hits / total;
+
+  stringstream report;
+  report << "Handle pool: " << hits << "/" << total 
+         << " reused (" << hitRate << "%), " << idle << " idle";
+  return report.str();
+}
+
+void Networking::FileDownloader::holdRequest( Networking::RequestId id,
+                                              CURL* easyHandle, 
+                                              double when )
+{
+  Networking::HeldRequest held;
+  held.id         = id;
+  held.easyHandle = easyHandle;
+  held.retryAt    = when;
+  self_retries.push_back( held );
+
+  Networking::TransferTable::iterator found = self_transfers.find( id );
+  if ( found != self_transfers.end() )
+    this -> setState( found -> second, Networking::HELD );
+}
+
+void Networking::FileDownloader::releaseRetries( double now )
 {
+  // Puts held requests whose time has come back in the admission queue
+  if ( self_serverUnreachable )
+  {
+    // Only one probe at a time, and only when its backoff has run out
+    if ( self_probeId != 0 or now < self_nextProbe or self_retries.empty() )
+      return;
+
+    Networking::HeldRequest probe = self_retries.front();
+    self_retries.pop_front();
+    self_probeId = probe.id;
+
+    // The probe skips the admission queue, nothing else is running
+    Networking::TransferTable::iterator found;
+    found = self_transfers.find( probe.id );
+    if ( found != self_transfers.end() )
+    {
+      this -> setState( found -> second, Networking::RUNNING );
+      this -> routeTransfer( found -> second );
+    }
+    curl_multi_add_handle( self_multiHandle, probe.easyHandle );
+    return;
+  }
+
+  Networking::RetryQueue stillHeld;
+  for ( size_t i = 0; i < self_retries.size(); i++ )
+  {
+    if ( self_retries[i].retryAt <= now )
+    {
+      Networking::TransferTable::iterator found;
+      found = self_transfers.find( self_retries[i].id );
+      if ( found != self_transfers.end() )
+        this -> setState( found -> second, Networking::WAITING );
+    }
+    else
+      stillHeld.push_back( self_retries[i] );
+  }
+  self_retries.swap( stillHeld );
+}
+
+void Networking::FileDownloader::requestFailed( 
+                                          Networking::Transfer* transfer,
+                                          CURLcode result )
+{
+  CURL* easyHandle = transfer -> easyHandle;
+  Networking::RequestId id = transfer -> id;
+  curl_multi_remove_handle( self_multiHandle, easyHandle );
+
+  double now = dtime();
+  Networking::FileInformation& failedFile = transfer -> info;
+  failedFile . attempts++;
+
+  // Whatever arrived in memory before the failure is thrown away, a part
+  // file is kept to resume from if it can be
+  bool resuming = false;
+  if ( failedFile . memorySink != NULL )
+    failedFile . memorySink -> clear();
+  else
+    resuming = this -> prepareResume( easyHandle, failedFile, result );
+
+  // Couldn't connect is special as this will happen with no VM present, 
+  // so rather than every request hammering away the whole queue waits on 
+  // one probe.
+  if ( result == CURLE_COULDNT_CONNECT or 
+       result == CURLE_COULDNT_RESOLVE_HOST )
+  {
+    // Unless another server can take over straight away
+    if ( this -> serverFailed( transfer ) )
+    {
+      if ( id == self_probeId )
+        self_probeId = 0;
+      this -> holdRequest( id, easyHandle, now );
+      return;
+    }
+
+    if ( ! self_serverUnreachable )
+    {
+      stringstream message;
+      message << "Server unreachable, holding downloads";
+      this -> report( false, message );
+    }
+
+    if ( id == self_probeId or ! self_serverUnreachable )
+    {
+      self_probeFailures++;
+      self_nextProbe = now + Networking::retryDelay( self_probeFailures );
+    }
+    if ( id == self_probeId )
+      self_probeId = 0;
+
+    self_serverUnreachable = true;
+    this -> holdRequest( id, easyHandle, 0 );
+    return;
+  }
 
-  curl_multi_perform(self_multiHandle, &self_numActive);
+  if ( id == self_probeId )
+    self_probeId = 0;
 
+  // The server wouldn't resume, which isn't worth waiting on - the part
+  // file has been emptied and the retry starts from the beginning
+  if ( result == CURLE_RANGE_ERROR )
+  {
+    stringstream message;
+    message << "Unable to resume \"" << failedFile.filePath 
+            << "\", starting again";
+    this -> report( false, message );
+    this -> holdRequest( id, easyHandle, now );
+    return;
+  }
+
+  // Anything else is this request's own problem, relay an error message
+  // and back off
+  stringstream error;
+  error << "Unhandled error downloading \"" << failedFile.filePath 
+        << "\" - " << curl_easy_strerror(result);
+  if ( result == CURLE_HTTP_RETURNED_ERROR )
+  {
+    long responseCode = 0;
+    curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+    error << " (" << responseCode << ")";
+  }
+  if ( resuming )
+    error << ", will resume from byte " << failedFile . resumeFrom;
+  this -> report( true, error );
+
+  double delay = Networking::retryDelay( failedFile . attempts );
+  this -> holdRequest( id, easyHandle, now + delay );
+}
+
+void Networking::FileDownloader::serverReachable()
+{
+  // The server has answered, so wake everything that was waiting on it
+  self_probeId = 0;
+  self_probeFailures = 0;
+
+  if ( ! self_serverUnreachable )
+    return;
+
+  stringstream message;
+  message << "Server reachable again, releasing " 
+          << self_retries.size() << " held downloads";
+  this -> report( false, message );
+  self_serverUnreachable = false;
+
+  for ( size_t i = 0; i < self_retries.size(); i++ )
+    self_retries[i].retryAt = 0;
+}
+
+void Networking::FileDownloader::run()
+{
+  // The network thread's loop
+  while ( self_running )
+    this -> step( true );
+}
+
+void Networking::FileDownloader::step( bool sleep )
+{
+  // One turn of the network loop. With sleep set, waits until there's
+  // something to do next.
+  this -> applySettings();
+  this -> applyServers();
+
+  Networking::Transfer* transfer;
+  while ( self_submitted.pop( transfer ) )
+    this -> startTransfer( transfer );
+  this -> applyPriorityChanges();
+
+  double now = dtime();
+  this -> probeServers( now );
+  this -> releaseRetries( now );
+  this -> admitTransfers();
+
+  int stillRunning;
+  curl_multi_perform( self_multiHandle, &stillRunning );
+  this -> readMessages();
+
+  if ( ! sleep )
+    return;
+
+  // Sleep until there's something to do
+  int timeout = this -> pollTimeout( dtime() );
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_poll( self_multiHandle, NULL, 0, timeout, NULL );
+#else
+  curl_multi_wait( self_multiHandle, NULL, 0, timeout, NULL );
+#endif
+}
+
+void Networking::FileDownloader::startTransfer( 
+                                           Networking::Transfer* transfer )
+{
+  Networking::FileInformation& fileInfo = transfer -> info;
+
+  //Allow the user to choose a different place to put the file (or memory)
+  //if necessary. Freshness checks have no body to put anywhere.
+  if (fileInfo . filep == NULL and fileInfo . memorySink == NULL and
+      fileInfo . freshness == NULL)
+    this -> openDownload( transfer -> filename, fileInfo );
+
+  // The ID rides along on the easy handle, so it can be recovered however
+  // the handle comes back to us.
+  Networking::RequestId id = transfer -> id;
+
+  //Make and setup the easyHandle
+  CURL* easyHandle = this -> acquireHandle();
+  transfer -> easyHandle = easyHandle;
+  curl_easy_setopt(easyHandle, CURLOPT_URL, fileInfo . filePath.c_str());
+  curl_easy_setopt(easyHandle, CURLOPT_PRIVATE, (void*) id);
+
+  //HTTP/2 is offered (as an upgrade, the VM server speaks plain HTTP) and
+  //the transfer waits for a connection it can multiplex onto rather than
+  //opening one of its own
+  if ( self_settings.multiplex )
+  {
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_easy_setopt(easyHandle, CURLOPT_HTTP_VERSION, 
+                     CURL_HTTP_VERSION_2_0);
+    curl_easy_setopt(easyHandle, CURLOPT_PIPEWAIT, 1L);
+#endif
+  }
+  else
+    curl_easy_setopt(easyHandle, CURLOPT_HTTP_VERSION, 
+                     CURL_HTTP_VERSION_1_1);
+
+  if (fileInfo . freshness != NULL)
+    curl_easy_setopt(easyHandle, CURLOPT_NOBODY, 1L);
+  else if (fileInfo . memorySink != NULL)
+  {
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEFUNCTION, &appendToMemory);
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, fileInfo . memorySink);
+  }
+  else if (fileInfo . streamFunc != NULL)
+  {
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEFUNCTION, &writeAndStream);
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, &fileInfo);
+  }
+  else
+    curl_easy_setopt(easyHandle, CURLOPT_WRITEDATA, fileInfo . filep);
+
+  //A stalled transfer fails, rather than hanging on, so it can be resumed
+  if ( ! fileInfo . longPoll )
+  {
+    curl_easy_setopt(easyHandle, CURLOPT_LOW_SPEED_LIMIT, stallSpeed);
+    curl_easy_setopt(easyHandle, CURLOPT_LOW_SPEED_TIME, stallTime);
+  }
+  if ( fileInfo . maxTime > 0 )
+    curl_easy_setopt(easyHandle, CURLOPT_TIMEOUT, fileInfo . maxTime);
+
+  //Save the information (the header callback writes into it)
+  self_transfers[ id ] = transfer;
+  this -> prepareCaching( easyHandle, fileInfo );
+
+  //Whilst the server is down new requests wait for the probe with the rest,
+  //otherwise they wait their turn in admitTransfers()
+  if ( self_serverUnreachable )
+    this -> holdRequest( id, easyHandle, 0 );
+  else
+    this -> setState( transfer, Networking::WAITING );
+}
+
+void Networking::FileDownloader::setConnections( 
+                           const Networking::ConnectionSettings& settings )
+{
+  // Render thread - picked up by the network thread on its next pass
+  pthread_mutex_lock( &self_settingsLock );
+  self_pendingSettings = settings;
+  self_settingsChanged = true;
+  pthread_mutex_unlock( &self_settingsLock );
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup( self_multiHandle );
+#endif
+}
+
+void Networking::FileDownloader::applySettings()
+{
+  pthread_mutex_lock( &self_settingsLock );
+  bool changed = self_settingsChanged;
+  self_settings = self_pendingSettings;
+  self_settingsChanged = false;
+  pthread_mutex_unlock( &self_settingsLock );
+
+  if ( ! changed )
+    return;
+
+  // Transfers over the limits wait in the multi handle for a connection
+  // to come free
+#if LIBCURL_VERSION_NUM >= 0x071e00
+  curl_multi_setopt( self_multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                     self_settings.maxTotal );
+  curl_multi_setopt( self_multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                     self_settings.maxPerHost );
+#endif
+
+  // HTTP/1.1 pipelining went from libcurl in 7.62, after that only
+  // multiplexing is left to choose
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  long pipelining = CURLPIPE_NOTHING;
+  if ( self_settings.multiplex )
+    pipelining = CURLPIPE_MULTIPLEX;
+#if LIBCURL_VERSION_NUM < 0x073e00
+  else
+    pipelining = CURLPIPE_HTTP1;
+#endif
+  curl_multi_setopt( self_multiHandle, CURLMOPT_PIPELINING, pipelining );
+#endif
+
+  stringstream message;
+  message << "Connections: " << self_settings.maxTotal << " total, " 
+          << self_settings.maxPerHost << " per host, "
+          << ( self_settings.multiplex ? "HTTP/2" : "HTTP/1.1" );
+  this -> report( false, message );
+}
+
+void Networking::FileDownloader::setServers( 
+                                   const Networking::ServerList& servers )
+{
+  // Render thread - picked up by the network thread on its next pass
+  pthread_mutex_lock( &self_settingsLock );
+  self_pendingServers = servers;
+  self_serversChanged = true;
+  pthread_mutex_unlock( &self_settingsLock );
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup( self_multiHandle );
+#endif
+}
+
+void Networking::FileDownloader::applyServers()
+{
+  pthread_mutex_lock( &self_settingsLock );
+  bool changed = self_serversChanged;
+  Networking::ServerList servers = self_pendingServers;
+  self_serversChanged = false;
+  pthread_mutex_unlock( &self_settingsLock );
+
+  if ( ! changed )
+    return;
+
+  // An empty list means the default server alone
+  if ( servers.empty() )
+  {
+    servers.resize( 1 );
+    servers[0].address = self_defaultServerAddress;
+  }
+
+  // Servers already known keep what has been learnt about them
+  vector< Networking::ServerState > newServers;
+  stringstream message;
+  message << "Servers:";
+  for ( size_t i = 0; i < servers.size(); i++ )
+  {
+    Networking::ServerState state;
+    state.address     = servers[i].address;
+    state.healthy     = true;
+    state.latency     = -1;
+    state.failures    = 0;
+    state.nextProbe   = 0;
+    state.probeHandle = NULL;
+
+    for ( size_t j = 0; j < self_servers.size(); j++ )
+    {
+      if ( self_servers[j].address == state.address )
+      {
+        state = self_servers[j];
+        self_servers[j].probeHandle = NULL;
+      }
+    }
+
+    state.weight = servers[i].weight > 0 ? servers[i].weight : 1;
+    newServers.push_back( state );
+    message << " " << state.address;
+  }
+
+  // Probes of servers no longer listed are abandoned
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+  {
+    if ( self_servers[i].probeHandle == NULL )
+      continue;
+    curl_multi_remove_handle( self_multiHandle, 
+                              self_servers[i].probeHandle );
+    this -> releaseHandle( self_servers[i].probeHandle );
+  }
+  self_servers.swap( newServers );
+
+  // Transfers know their server by its place in the list, which may have
+  // changed
+  Networking::TransferTable::iterator itr;
+  for ( itr = self_transfers.begin(); itr != self_transfers.end(); itr++ )
+    itr -> second -> server = -1;
+
+  this -> report( false, message );
+}
+
+void Networking::FileDownloader::probeServers( double now )
+{
+  // With only one server there is nothing to choose between, and the
+  // held request probe covers it going away
+  if ( self_servers.size() < 2 )
+    return;
+
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+  {
+    Networking::ServerState& server = self_servers[i];
+    if ( server.probeHandle != NULL or now < server.nextProbe )
+      continue;
+
+    // Just the headers of the server root, any answer at all will do
+    string url = server.address + "/";
+    CURL* probe = this -> acquireHandle();
+    curl_easy_setopt( probe, CURLOPT_URL, url.c_str() );
+    curl_easy_setopt( probe, CURLOPT_NOBODY, 1L );
+    curl_easy_setopt( probe, CURLOPT_CONNECTTIMEOUT, serverProbeTimeout );
+    curl_easy_setopt( probe, CURLOPT_TIMEOUT, 2 * serverProbeTimeout );
+    curl_easy_setopt( probe, CURLOPT_PRIVATE, (void*) 0 );
+    server.probeHandle = probe;
+    curl_multi_add_handle( self_multiHandle, probe );
+  }
+}
+
+bool Networking::FileDownloader::probeAnswered( CURL* easyHandle, 
+                                                CURLcode result )
+{
+  // Returns false if easyHandle isn't a server probe
+  Networking::ServerState* server = NULL;
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+    if ( self_servers[i].probeHandle == easyHandle )
+      server = &self_servers[i];
+
+  if ( server == NULL )
+    return false;
+
+  long   responseCode = 0;
+  double probeTime    = 0;
+  curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+  curl_easy_getinfo( easyHandle, CURLINFO_TOTAL_TIME, &probeTime );
+  curl_multi_remove_handle( self_multiHandle, easyHandle );
+  this -> releaseHandle( easyHandle );
+  server -> probeHandle = NULL;
+
+  // Errors from the server itself count against it too
+  double now = dtime();
+  if ( result == CURLE_OK and responseCode > 0 and responseCode < 500 )
+  {
+    if ( server -> latency < 0 )
+      server -> latency = probeTime;
+    else
+      server -> latency += latencySmoothing * 
+                           ( probeTime - server -> latency );
+    server -> failures  = 0;
+    server -> nextProbe = now + serverProbeInterval;
+    this -> setHealth( *server, true );
+  }
+  else
+  {
+    server -> failures++;
+    server -> nextProbe = now + 
+                          Networking::retryDelay( server -> failures );
+    this -> setHealth( *server, false );
+  }
+
+  return true;
+}
+
+void Networking::FileDownloader::routeTransfer( 
+                                           Networking::Transfer* transfer )
+{
+  // Points a transfer for a relative path at the best server. Those with
+  // a probe time beat those without, so until the probes are in the list
+  // order decides.
+  transfer -> server = -1;
+  if ( self_servers.empty() or transfer -> filename.empty() or 
+       transfer -> filename[0] != '/' )
+    return;
+
+  int best = -1;
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+  {
+    const Networking::ServerState& server = self_servers[i];
+    if ( ! server.healthy )
+      continue;
+
+    if ( best < 0 )
+    {
+      best = i;
+      continue;
+    }
+
+    const Networking::ServerState& current = self_servers[ best ];
+    if ( server.latency >= 0 and 
+         ( current.latency < 0 or server.latency / server.weight < 
+                                  current.latency / current.weight ) )
+      best = i;
+  }
+
+  // Nothing is healthy, so this is the held requests' probe
+  if ( best < 0 )
+    best = 0;
+
+  transfer -> server = best;
+  string url = self_servers[ best ].address + transfer -> filename;
+  curl_easy_setopt( transfer -> easyHandle, CURLOPT_URL, url.c_str() );
+}
+
+bool Networking::FileDownloader::serverFailed( 
+                                           Networking::Transfer* transfer )
+{
+  // A transfer couldn't reach its server. Returns true if there is 
+  // another healthy server for it to fail over to.
+  if ( transfer -> server < 0 or 
+       transfer -> server >= (int) self_servers.size() )
+    return false;
+
+  Networking::ServerState& server = self_servers[ transfer -> server ];
+  server.failures++;
+  server.nextProbe = dtime() + Networking::retryDelay( server.failures );
+  this -> setHealth( server, false );
+
+  for ( size_t i = 0; i < self_servers.size(); i++ )
+    if ( self_servers[i].healthy )
+      return true;
+  return false;
+}
+
+void Networking::FileDownloader::setHealth( Networking::ServerState& server,
+                                            bool healthy )
+{
+  if ( server.healthy == healthy )
+    return;
+
+  server.healthy = healthy;
+  if ( self_servers.size() > 1 )
+  {
+    stringstream message;
+    message << "Server " << server.address 
+            << ( healthy ? " is answering" : " is unreachable" );
+    this -> report( false, message );
+  }
+
+  // The held requests can go to this one now
+  if ( healthy and self_serverUnreachable )
+    this -> serverReachable();
+}
+
+void Networking::FileDownloader::reprioritise( Networking::RequestId id,
+                                          Networking::Priority priority )
+{
+  // Render thread - takes effect on the network thread's next pass
+  Networking::PriorityChange change;
+  change.id       = id;
+  change.priority = priority;
+  self_priorityChanges.push( change );
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_wakeup( self_multiHandle );
+#endif
+}
+
+void Networking::FileDownloader::applyPriorityChanges()
+{
+  // Changes to finished (or answered from the cache) requests are dropped
+  Networking::PriorityChange change;
+  while ( self_priorityChanges.pop( change ) )
+  {
+    Networking::TransferTable::iterator found;
+    found = self_transfers.find( change.id );
+    if ( found == self_transfers.end() )
+      continue;
+
+    // Out of the queues and back in, so it is filed under its new class
+    Networking::Transfer* transfer = found -> second;
+    this -> unqueueTransfer( transfer );
+    transfer -> info . priority = change.priority;
+    this -> setState( transfer, transfer -> state );
+  }
+}
+
+bool Networking::MoreUrgent::operator()( const Transfer* a,
+                                         const Transfer* b ) const
+{
+  // Long polls first as they don't wait their turn, then the most urgent
+  // class, oldest request first within a class
+  if ( a -> info . longPoll != b -> info . longPoll )
+    return a -> info . longPoll;
+  if ( a -> info . priority != b -> info . priority )
+    return a -> info . priority < b -> info . priority;
+  return a -> id < b -> id;
+}
+
+void Networking::FileDownloader::unqueueTransfer( 
+                                           Networking::Transfer* transfer )
+{
+  self_waitingQueue.erase( transfer );
+  self_runningQueue.erase( transfer );
+}
+
+void Networking::FileDownloader::setState( Networking::Transfer* transfer,
+                                           Networking::TransferState state )
+{
+  // Every change of state goes through here, so the admission queues
+  // always hold what they should
+  this -> unqueueTransfer( transfer );
+  transfer -> state = state;
+
+  if ( state == Networking::WAITING or state == Networking::PAUSED )
+    self_waitingQueue.insert( transfer );
+  else if ( state == Networking::RUNNING and ! transfer -> info . longPoll )
+    self_runningQueue.insert( transfer );
+}
+
+void Networking::FileDownloader::admitTransfers()
+{
+  // Runs up to maxTransfers at once, the most urgent first. If everything
+  // running is less urgent than something waiting, the least urgent is 
+  // paused to make way. That is only done on multiplexed connections - a
+  // paused HTTP/1.1 transfer would keep its connection to itself. Long
+  // polls spend their time waiting on the server, so don't count.
+  long window = self_settings.maxTransfers;
+  while ( ! self_waitingQueue.empty() )
+  {
+    Networking::Transfer* next = *self_waitingQueue.begin();
+
+    if ( ! next -> info . longPoll and window > 0 and 
+         (long) self_runningQueue.size() >= window )
+    {
+      Networking::Transfer* leastUrgent = *self_runningQueue.rbegin();
+      if ( ! self_settings.multiplex or 
+           next -> info . priority >= leastUrgent -> info . priority )
+        break;
+
+      curl_easy_pause( leastUrgent -> easyHandle, CURLPAUSE_ALL );
+      this -> setState( leastUrgent, Networking::PAUSED );
+    }
+
+    if ( next -> state == Networking::PAUSED )
+      curl_easy_pause( next -> easyHandle, CURLPAUSE_CONT );
+    else
+    {
+      this -> routeTransfer( next );
+      curl_multi_add_handle( self_multiHandle, next -> easyHandle );
+    }
+
+    this -> setState( next, Networking::RUNNING );
+  }
+}
+
+int Networking::FileDownloader::pollTimeout( double now )
+{
+  // How long until the next held request is due, in milliseconds
+  double wait = idlePollTimeout / 1000.0;
+
+  if ( self_serverUnreachable and self_probeId == 0 and 
+       ! self_retries.empty() )
+    wait = self_nextProbe - now;
+  else if ( ! self_serverUnreachable )
+  {
+    for ( size_t i = 0; i < self_retries.size(); i++ )
+    {
+      if ( self_retries[i].retryAt - now < wait )
+        wait = self_retries[i].retryAt - now;
+    }
+  }
+
+  if ( self_servers.size() > 1 )
+  {
+    for ( size_t i = 0; i < self_servers.size(); i++ )
+    {
+      if ( self_servers[i].probeHandle == NULL and 
+           self_servers[i].nextProbe - now < wait )
+        wait = self_servers[i].nextProbe - now;
+    }
+  }
+
+  if ( wait < 0 )
+    return 0;
+  if ( wait * 1000 > idlePollTimeout )
+    return idlePollTimeout;
+  return int( wait * 1000 );
+}
+
+void Networking::FileDownloader::readMessages()
+{
   int numMessages;
   do 
   {
     CURLMsg *message = curl_multi_info_read(self_multiHandle, &numMessages);
-    if (message != NULL) 
+    if (message == NULL or message -> msg != CURLMSG_DONE) 
+      continue;
+
+    //Readability variables
+    CURLcode result  = message -> data.result;
+    CURL* easyHandle = message -> easy_handle;
+
+    //Server probes aren't transfers
+    if ( this -> probeAnswered( easyHandle, result ) )
+      continue;
+
+    Networking::TransferTable::iterator found;
+    found = self_transfers.find( this -> requestIdOf( easyHandle ) );
+    if ( found == self_transfers.end() )
+      continue;
+
+    Networking::Transfer* transfer = found -> second;
+
+    //A resumed request the server can't satisfy (the part file already
+    //holds everything, or more) is started again
+    long responseCode = 0;
+    curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, &responseCode );
+    if ( result == CURLE_OK and responseCode == 416 and 
+         transfer -> info . resumeFrom > 0 )
+      result = CURLE_RANGE_ERROR;
+
+    //Neither a body nor a 304 (a 404, or a 503 from a busy server) is a
+    //failure like any other, and is backed off from and retried. Freshness
+    //checks want to hear about a missing file, and long polls go back to
+    //whoever made them anyway.
+    bool answered = responseCode == 200 or responseCode == 206 or
+                    responseCode == 304;
+    if ( result == CURLE_OK and ! answered and 
+         transfer -> info . freshness == NULL and 
+         ! transfer -> info . longPoll )
+      result = CURLE_HTTP_RETURNED_ERROR;
+
+    if (result == CURLE_OK)
     {
-      //Readability variables
-      CURLcode result  = message -> data.result;
-      CURL* easyHandle = message -> easy_handle;
+      this -> serverReachable();
+      if ( transfer -> server >= 0 and 
+           transfer -> server < (int) self_servers.size() )
+        this -> setHealth( self_servers[ transfer -> server ], true );
 
-      if (result == CURLE_OK)
-      {
-        Networking::FileInformation completedFile = 
-                                                 self_fileInfos[easyHandle];
-        //Report the success
-        Errors::dbg << "Successful download of file \"" 
-                    << completedFile.filePath
-                    << "\"" << endl;
-
-        //Close file and run the finish function (if it exists)
-        fclose(completedFile . filep);
-
-        if (completedFile . finishResponse != NULL)
-        {
-          (*(completedFile . finishResponse))( easyHandle );
-        }
-
-        //Kill the fileInfo, and clean up the easyHandles
-        self_fileInfos.erase(easyHandle);
-        curl_multi_remove_handle(self_multiHandle, easyHandle);
-        curl_easy_cleanup(easyHandle);
-      }
-      else
-      {
-        //If we couldn't connect, retry the handle as we really should be
-        //able to.
-        curl_multi_remove_handle(self_multiHandle, easyHandle);
-        curl_multi_add_handle   (self_multiHandle, easyHandle);
-        self_numActive++;
-
-        // If it isn't a "couldn't connect" then relay an error message
-        // Couldn't connect is special as this will happen with no VM present
-        if (result  != CURLE_COULDNT_CONNECT)
-        {
-          Networking::FileInformation completedFile = 
-                                                 self_fileInfos[easyHandle];
-          string errorDescription = curl_easy_strerror(result);
-  
-          Errors::err << "Unhandled error downloading \"" 
-                      << completedFile.filePath 
-                      << "\" - " << errorDescription << endl;
-        }
-      }
+      //Report the success
+      stringstream success;
+      success << "Successful download of file \"" 
+              << transfer -> info . filePath << "\"";
+      this -> report( false, success );
+
+      //Close file and bring the cache up to date
+      if (transfer -> info . filep != NULL)
+        fclose(transfer -> info . filep);
+      transfer -> unchanged = this -> completeDownload( easyHandle, 
+                                                     transfer -> info );
+
+      //Hand it back to the render thread
+      curl_multi_remove_handle( self_multiHandle, easyHandle );
+      this -> unqueueTransfer( transfer );
+      self_transfers.erase( found );
+      self_completed.push( transfer );
+    }
+    else if ( transfer -> info . longPoll )
+    {
+      //A long poll that fails (or is held past its time) goes straight 
+      //back, so whoever made it can fall back on something else
+      stringstream message;
+      message << "Long poll \"" << transfer -> info . filePath 
+              << "\" ended - " << curl_easy_strerror(result);
+      this -> report( false, message );
+
+      if (transfer -> info . filep != NULL)
+        fclose(transfer -> info . filep);
+      if (transfer -> info . memorySink != NULL)
+        transfer -> info . memorySink -> clear();
+      curl_multi_remove_handle( self_multiHandle, easyHandle );
+      this -> unqueueTransfer( transfer );
+      self_transfers.erase( found );
+      self_completed.push( transfer );
+    }
+    else
+    {
+      //Failed transfers are held back and retried later, see
+      //requestFailed()
+      this -> requestFailed( transfer, result );
     }
   }
   while (numMessages != 0);
 }
 
+void Networking::FileDownloader::process()
+{
+  // Render thread - pass on anything the network thread had to say, and
+  // run the finish responses of completed transfers. If there's no 
+  // network thread, this is where the network work gets done.
+  if ( ! self_threaded )
+    this -> step( false );
+
+  Networking::LogMessage logMessage;
+  while ( self_log.pop( logMessage ) )
+  {
+    if ( logMessage.isError )
+      Errors::err << logMessage.text << endl;
+    else
+      Errors::dbg << logMessage.text << endl;
+  }
+
+  Networking::Transfer* transfer;
+  bool finishedAny = false;
+  while ( ! self_answered.empty() )
+  {
+    transfer = self_answered.front();
+    self_answered.pop_front();
+    this -> finishTransfer( transfer );
+    finishedAny = true;
+  }
+
+  while ( self_completed.pop( transfer ) )
+  {
+    this -> finishTransfer( transfer );
+    finishedAny = true;
+  }
+
+  if ( finishedAny and self_requestsActive == 0 )
+    Errors::dbg << this -> poolReport() << endl;
+
+  Cache::flush();
+}
+
+void Networking::FileDownloader::recordMetrics( 
+                                           Networking::Transfer* transfer )
+{
+  // The network thread is done with the handle by now, so it can be read
+  // from here. Long polls would only swamp the timings.
+  if ( transfer -> info . longPoll )
+    return;
+
+  Metrics::Sample sample;
+  sample.url           = transfer -> info . filePath;
+  sample.responseCode  = 0;
+  sample.dnsTime       = 0;
+  sample.connectTime   = 0;
+  sample.firstByteTime = 0;
+  sample.totalTime     = 0;
+  sample.bytes         = 0;
+  sample.throughput    = 0;
+  sample.attempts      = transfer -> info . attempts;
+  sample.cacheHit      = true;
+
+  CURL* easyHandle = transfer -> easyHandle;
+  if ( easyHandle != NULL )
+  {
+    curl_easy_getinfo( easyHandle, CURLINFO_RESPONSE_CODE, 
+                       &sample.responseCode );
+    curl_easy_getinfo( easyHandle, CURLINFO_NAMELOOKUP_TIME, 
+                       &sample.dnsTime );
+    curl_easy_getinfo( easyHandle, CURLINFO_CONNECT_TIME, 
+                       &sample.connectTime );
+    curl_easy_getinfo( easyHandle, CURLINFO_STARTTRANSFER_TIME, 
+                       &sample.firstByteTime );
+    curl_easy_getinfo( easyHandle, CURLINFO_TOTAL_TIME, 
+                       &sample.totalTime );
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t bytes = 0;
+    curl_off_t throughput = 0;
+    curl_easy_getinfo( easyHandle, CURLINFO_SIZE_DOWNLOAD_T, &bytes );
+    curl_easy_getinfo( easyHandle, CURLINFO_SPEED_DOWNLOAD_T, &throughput );
+    sample.bytes      = (double) bytes;
+    sample.throughput = (double) throughput;
+#else
+    curl_easy_getinfo( easyHandle, CURLINFO_SIZE_DOWNLOAD, 
+                       &sample.bytes );
+    curl_easy_getinfo( easyHandle, CURLINFO_SPEED_DOWNLOAD, 
+                       &sample.throughput );
+#endif
+    sample.cacheHit = sample.responseCode == 304;
+  }
+
+  Metrics::record( sample );
+}
+
+void Networking::FileDownloader::finishTransfer( 
+                                           Networking::Transfer* transfer )
+{
+  Networking::FileInformation& completedFile = transfer -> info;
+
+  Networking::PathIndex::iterator path;
+  path = self_queuedPaths.find( completedFile . filePath );
+  if ( path != self_queuedPaths.end() and --(path -> second) <= 0 )
+    self_queuedPaths.erase( path );
+  self_requestsActive--;
+
+  this -> recordMetrics( transfer );
+
+  if ( completedFile . freshness != NULL )
+    this -> answerFreshness( transfer );
+
+  //Run the finish function (if it exists). Content the caller already 
+  //has gets the unchanged response instead, if it asked for one.
+  responseFunc response = completedFile . finishResponse;
+  if ( transfer -> unchanged and completedFile . unchangedResponse )
+    response = completedFile . unchangedResponse;
+
+  if (response != NULL)
+    (*response)( transfer -> easyHandle, completedFile . userData );
+
+  //Kill the transfer, and clean up the easyHandle
+  curl_slist_free_all( completedFile . headers );
+  this -> releaseHandle( transfer -> easyHandle );
+  delete transfer;
+}
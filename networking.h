@@ -3,54 +3,391 @@
 
 #include <cstdio>
 #include <string>
+#include <sstream>
 #include <map>
+#include <vector>
+#include <deque>
+#include <set>
+#include <tr1/unordered_map>
+
+#include <pthread.h>
 
 #include <curl/curl.h>
 
+#include "lockfree.h"
+
 
 namespace Networking
 {
-  typedef void (*responseFunc)( CURL* ); 
+  // Finish responses are handed the completed easy handle and whatever
+  // userData was stored in the FileInformation when it was queued.
+  //
+  // Requests are conditional whenever the file is cached. If the server
+  // says a file is unchanged and its current content has already been
+  // handed to a finish response, then unchangedResponse is called instead
+  // (where set), so the caller can skip reprocessing it. Files answered
+  // straight from the cache (see setFresh()) have no easy handle, so it 
+  // is NULL for those.
+  typedef void (*responseFunc)( CURL*, void* ); 
+
+  // Downloads to a file can also be watched as they arrive. Every chunk
+  // of a 200 or 206 body is handed to a chunkFunc on the network thread
+  // (the file is written and cached as usual). A NULL chunk means the body
+  // is starting over, so anything seen so far should be forgotten.
+  typedef void (*chunkFunc)( const char* data, size_t size, void* );
+
+  // Transfers are admitted to the multi handle most urgent first, and on
+  // a multiplexed connection a less urgent one is paused to make way for
+  // a more urgent one.
+  enum Priority
+  {
+    CONTROL,   // Configuration and resources, everything else waits on them
+    ACTIVE,    // What the active view shows
+    PREFETCH   // Everything else
+  };
+
+  struct Freshness;
 
   struct FileInformation
   {
     std::string filePath;
     responseFunc finishResponse;
+    responseFunc unchangedResponse;
+    void* userData;
     FILE* filep;
     time_t modTime;
+    int attempts;
+    Priority priority;
+
+    // Caching - localPath is only known when the downloader opened filep
+    // itself, and only then is the download cached. The body goes to 
+    // partPath and only replaces localPath once it has fully arrived. The
+    // validators are filled in from the response headers.
+    std::string localPath;
+    std::string partPath;
+    std::string etag;
+    std::string lastModified;
+    struct curl_slist* headers;
+
+    // Resuming - how much of partPath a failed attempt left behind, and
+    // the validator of the response it came from (sent as If-Range)
+    long        resumeFrom;
+    std::string resumeValidator;
+
+    // If set the body is appended here instead of going to a file (it is
+    // cached all the same). Meant for small documents, such as JSON.
+    std::string* memorySink;
+
+    // Streaming, see chunkFunc. status is that of the response arriving.
+    chunkFunc streamFunc;
+    void*     streamData;
+    long      status;
+
+    // If set only the headers are asked for (a HEAD request), and what
+    // they say is filled in here, see checkFreshness()
+    Freshness* freshness;
+
+    // A request the server holds open until it has something to say (a
+    // long poll). It runs whatever the limit on transfers, and is never
+    // given up on as stalled. Nor is it retried if it fails, it's handed
+    // straight back for its owner to decide what next.
+    bool longPoll;
+
+    // Longest the whole request may take, in seconds. Zero for no limit.
+    long maxTime;
+
     FileInformation();
   };
 
-  typedef std::map< CURL*, FileInformation > FileInfoMap ;
+  // Every queued download gets a RequestId, which also travels on its
+  // easy handle as CURLOPT_PRIVATE. The network thread's transfer table is
+  // keyed on it, and the render thread's path index counts queued requests
+  // per online path, so neither completions nor isInQueue() have to 
+  // search.
+  typedef unsigned long RequestId;
+  typedef std::tr1::unordered_map< std::string, int > PathIndex;
+
+  // Content hash last handed to a finish response, by online path
+  typedef std::tr1::unordered_map< std::string, std::string > DeliveryMap;
+
+  // One download, passed from the render thread to the network thread by
+  // addFile() and back again once it has finished.
+  enum TransferState { WAITING, RUNNING, PAUSED, HELD };
+
+  struct Transfer
+  {
+    RequestId       id;
+    std::string     filename;
+    FileInformation info;
+    CURL*           easyHandle;
+    bool            unchanged;
+    TransferState   state;
+    int             server;     // Index in the server list, -1 for none
+  };
+
+  typedef std::tr1::unordered_map< RequestId, Transfer* > TransferTable;
+
+  // Transfers in admission order - long polls, then the most urgent class,
+  // then the oldest request. A transfer's priority mustn't change whilst
+  // it is in one of these.
+  struct MoreUrgent
+  {
+    bool operator()( const Transfer* a, const Transfer* b ) const;
+  };
+
+  typedef std::set< Transfer*, MoreUrgent > TransferQueue;
+
+  // A failed (or not yet started) request waiting out its backoff, off the
+  // multi handle.
+  struct HeldRequest
+  {
+    RequestId id;
+    CURL*     easyHandle;
+    double    retryAt;
+  };
+
+  typedef std::deque< HeldRequest > RetryQueue;
+
+  // Servers. Relative paths ("/event.png") are named by the default 
+  // server, the VM, but can be fetched from any server in the list - a
+  // host side cache or a project mirror, say. Each is probed in the 
+  // background, and requests go to the healthy one with the lowest probe
+  // time divided by its weight, failing over to the next when one stops
+  // answering. Ties go to the earlier server.
+  struct ServerSettings
+  {
+    std::string address;
+    double      weight;
+
+    ServerSettings();
+  };
+
+  typedef std::vector< ServerSettings > ServerList;
+
+  struct ServerState
+  {
+    std::string address;
+    double      weight;
+    bool        healthy;
+    double      latency;     // Smoothed probe time in seconds, -1 unknown
+    int         failures;
+    double      nextProbe;
+    CURL*       probeHandle; // While a probe is out
+  };
+
+  // Freshness checks - what the server has for a file, without its body.
+  // checkFreshness() makes a HEAD request per file, all at once, and hands
+  // the lot back to a single freshnessFunc once the last has answered.
+  struct Freshness
+  {
+    std::string filename;     // As passed to checkFreshness()
+    bool        found;        // The server answered with a 2xx or 304
+    time_t      modTime;      // -1 if the server didn't say
+    std::string etag;
+    std::string lastModified;
+    bool        cached;       // The cached copy is the server's, as
+                              // far as its validators tell
+  };
+
+  typedef std::vector< Freshness > FreshnessList;
+  typedef void (*freshnessFunc)( FreshnessList& results, void* userData );
+
+  struct FreshnessCheck
+  {
+    FreshnessList results;
+    int           pending;
+    freshnessFunc done;
+    void*         userData;
+  };
+
+  struct PriorityChange
+  {
+    RequestId id;
+    Priority  priority;
+  };
+
+  // Messages from the network thread, which mustn't write to the Errors
+  // streams itself as the render thread reads them.
+  struct LogMessage
+  {
+    bool        isError;
+    std::string text;
+  };
 
   //The class for file downloading
   //
-  //process() processes the asynchronous downloads - goes in the main loop
+  //The multi handle is driven by a thread of its own, which sleeps in 
+  //curl_multi_poll() until there is network activity, a retry is due, or
+  //addFile() wakes it. Requests reach it, and finished transfers come 
+  //back, through lock free queues, so downloads carry on at full speed
+  //however slowly frames are rendered.
+  //
+  //Easy handles are pooled and reused, and every transfer (synchronous or
+  //not) goes through one CURLSH share, so connections, DNS lookups and TLS
+  //sessions to the VM server are set up once rather than per file.
+  //
+  //process() hands back finished downloads - goes in the main loop. It
+  //does no network work itself, so costs next to nothing when idle.
   //addFile() is for initialising an asynchronous download.
   //getFile() makes synchronous downloads - this will block until finished
   //Once the download is finished then the argument finishFunction() 
-  //will be called.
+  //will be called (on the render thread, from process()).
+  // How the multi handle may use connections. Zero means no limit.
+  // With multiplex set, HTTP/2 is negotiated wherever the server offers
+  // it and transfers to one host share a connection. Without it requests
+  // are made over HTTP/1.1, pipelined where libcurl still supports that.
+  struct ConnectionSettings
+  {
+    long maxTotal;
+    long maxPerHost;
+    long maxTransfers;
+    bool multiplex;
+
+    ConnectionSettings();
+  };
+
   class FileDownloader
   {
     private:
       std::string self_defaultServerAddress;
-      int    self_numActive;
       CURLM* self_multiHandle;
 
-      FileInfoMap self_fileInfos;
+      // Render thread
+      RequestId    self_nextRequestId;
+      PathIndex    self_queuedPaths;
+      int          self_requestsActive;
+
+      // URLs whose cached copy is known to be current (they came in a
+      // bundle), requests for these never reach the network thread
+      std::set< std::string >  self_fresh;
+      std::deque< Transfer* >  self_answered;
+
+      bool      answerFromCache( Transfer* transfer );
+      void      finishTransfer ( Transfer* transfer );
+      void      recordMetrics  ( Transfer* transfer );
+      void      answerFreshness( Transfer* transfer );
+
+      // Hand over between the threads
+      LockFree::Queue< Transfer* >  self_submitted;
+      LockFree::Queue< Transfer* >  self_completed;
+      LockFree::Queue< LogMessage > self_log;
+      LockFree::Queue< PriorityChange > self_priorityChanges;
+
+      // Network thread
+      pthread_t     self_thread;
+      volatile bool self_running;
+      bool          self_threaded;
+      TransferTable self_transfers;
+
+      void      run();
+      void      step( bool sleep );
+      void      discardTransfer( Transfer* transfer );
+      void      startTransfer( Transfer* transfer );
+      void      readMessages();
+      int       pollTimeout( double now );
+      void      report( bool isError, const std::stringstream& message );
+
+      // Changed from the render thread, applied by the network thread
+      pthread_mutex_t    self_settingsLock;
+      ConnectionSettings self_pendingSettings;
+      bool               self_settingsChanged;
+      ConnectionSettings self_settings;
+
+      void      applySettings();
+      void      applyPriorityChanges();
+      void      admitTransfers();
+
+      // Admission queues, kept up to date by setState() so admitTransfers()
+      // only has to look at their ends. Long polls don't count as running.
+      TransferQueue self_waitingQueue;  // WAITING or PAUSED
+      TransferQueue self_runningQueue;  // RUNNING
+
+      void      setState( Transfer* transfer, TransferState state );
+      void      unqueueTransfer( Transfer* transfer );
+
+      // Server list - set from the render thread, probed and chosen from
+      // by the network thread
+      ServerList                 self_pendingServers;
+      bool                       self_serversChanged;
+      std::vector< ServerState > self_servers;
+
+      void      applyServers();
+      void      probeServers( double now );
+      bool      probeAnswered( CURL* easyHandle, CURLcode result );
+      void      routeTransfer( Transfer* transfer );
+      bool      serverFailed( Transfer* transfer );
+      void      setHealth( ServerState& server, bool healthy );
+
+      CURLSH*             self_share;
+      pthread_mutex_t     self_shareLocks[ CURL_LOCK_DATA_LAST ];
+      pthread_mutex_t     self_poolLock;
+      std::vector<CURL*>  self_handlePool;
+      unsigned long       self_poolHits;
+      unsigned long       self_poolMisses;
+
+      CURL*     acquireHandle();
+      void      releaseHandle( CURL* easyHandle );
+
+      pthread_mutex_t self_deliveredLock;
+      DeliveryMap     self_delivered;
+
+      void      openDownload    ( std::string filename, 
+                                  FileInformation& info );
+      void      prepareCaching  ( CURL* easyHandle, FileInformation& info );
+      bool      completeDownload( CURL* easyHandle, FileInformation& info );
+      bool      deliverCached   ( FileInformation& info );
+      bool      prepareResume   ( CURL* easyHandle, FileInformation& info,
+                                  CURLcode result );
+
+      // Retry scheduling. Failed requests back off exponentially (with
+      // jitter). If the server can't be reached at all then everything is
+      // held, and a single probe request is let out at a time until the
+      // server answers, at which point the lot are released.
+      RetryQueue self_retries;
+      bool       self_serverUnreachable;
+      int        self_probeFailures;
+      double     self_nextProbe;
+      RequestId  self_probeId;
+
+      void      holdRequest( RequestId id, CURL* easyHandle, double when );
+      void      releaseRetries( double now );
+      void      requestFailed( Transfer* transfer, CURLcode result );
+      void      serverReachable();
+
+      RequestId requestIdOf( CURL* easyHandle );
+
+      friend void* networkThread( void* downloader );
+      friend void  lockShare  ( CURL*, curl_lock_data, curl_lock_access, 
+                                void* );
+      friend void  unlockShare( CURL*, curl_lock_data, void* );
     public:
       FileDownloader( std::string defaultServerAddress );
+      ~FileDownloader();
       void   process       ();
-      void   addFile       ( std::string filename, FileInformation fileInfo);
-      long   getFileAge    ( std::string filename );
+      RequestId addFile    ( std::string filename, 
+                             FileInformation fileInfo );
+      void   checkFreshness( const std::vector<std::string>& filenames,
+                             freshnessFunc done, void* userData,
+                             Priority priority = ACTIVE );
       std::string getFile       ( std::string filename );
       std::string pathFromString( std::string path );
       bool   isInQueue( std::string filePath );
+      void   setFresh ( const std::vector<std::string>& filenames );
+      void   setConnections( const ConnectionSettings& settings );
+      void   setServers    ( const ServerList& servers );
+      void   reprioritise  ( RequestId id, Priority priority );
+      std::string poolReport();
   };
 
+  void* networkThread( void* downloader );
+  void  lockShare  ( CURL*, curl_lock_data, curl_lock_access, void* );
+  void  unlockShare( CURL*, curl_lock_data, void* );
+
   extern FileDownloader* fileDownloader;
 
   time_t fileModifyTime( std::string localPath );
+  bool   cacheable( const FileInformation& info );
+  double retryDelay( int attempts );
 };
 
 #endif //Include guard
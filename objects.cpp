@@ -26,14 +26,11 @@ using Graphics::Sprite;
 Objects::ViewList Objects::viewList;
 Objects::View*    Objects::activeView;
 
-void Objects::loadObjects( Json::Value objects )
+Json::Value viewsOf( Json::Value objects )
 {
-  // This function loads all the objects in the provided Json structure into
-  // their appropriate views.
   // If the Json structure is an array of objects then there is only one
   // view which is viewList[0]. If it is an array of arrays of objects then
   // each element represents a view, indexed in order of passing.
-
   Json::Value views;
 
   if ( objects[0u].isArray() )
@@ -41,6 +38,44 @@ void Objects::loadObjects( Json::Value objects )
   else
     views.append( objects );
 
+  return views;
+}
+
+Objects::Object* makeObject( const Json::Value& objectData )
+{
+  // Call correct construtor
+  // (NB These will be scattered around different headers because a
+  // single header will become too long.)
+  Objects::Object * newObj = NULL;
+  if (objectData["type"] == "boincValue")
+    newObj = new Objects::BoincValue(objectData);
+  if (objectData["type"] == "strings")
+    newObj = new Objects::StringDisplay(objectData);
+  if (objectData["type"] == "slideshow")
+    newObj = new Objects::Slideshow(objectData);
+  if (objectData["type"] == "gridshow")
+    newObj = new Objects::Gridshow(objectData);
+  if (objectData["type"] == "spriteDisplay")
+    newObj = new Objects::SpriteDisplay(objectData);
+  if (objectData["type"] == "panSprite")
+    newObj = new Objects::PanSprite(objectData);
+  if (objectData["type"] == "errorDisplay")
+    newObj = new Objects::ErrorDisplay(objectData);
+  if (objectData["type"] == "debugDisplay")
+    newObj = new Objects::DebugDisplay(objectData);
+
+  if ( newObj == NULL )
+    Errors::err << "Unknown object type " << objectData["type"].asString()
+                << endl;
+  return newObj;
+}
+
+void Objects::loadObjects( Json::Value objects )
+{
+  // This function loads all the objects in the provided Json structure into
+  // their appropriate views.
+  Json::Value views = viewsOf( objects );
+
   for (size_t viewI = 0; viewI < views.size(); viewI++)
   {
     // Make a new view
@@ -50,30 +85,9 @@ void Objects::loadObjects( Json::Value objects )
     // Add objects into it
     for (size_t n = 0; n < viewObjects.size(); n++)
     {
-      Objects::Object * newObj;
-      Json::Value objectData = viewObjects[n];
-  
-      // Call correct construtor
-      // (NB These will be scattered around different headers because a
-      // single header will become too long.)
-      if (objectData["type"] == "boincValue")
-        newObj = new Objects::BoincValue(objectData);
-      if (objectData["type"] == "strings")
-        newObj = new Objects::StringDisplay(objectData);
-      if (objectData["type"] == "slideshow")
-        newObj = new Objects::Slideshow(objectData);
-      if (objectData["type"] == "gridshow")
-        newObj = new Objects::Gridshow(objectData);
-      if (objectData["type"] == "spriteDisplay")
-        newObj = new Objects::SpriteDisplay(objectData);
-      if (objectData["type"] == "panSprite")
-        newObj = new Objects::PanSprite(objectData);
-      if (objectData["type"] == "errorDisplay")
-        newObj = new Objects::ErrorDisplay(objectData);
-      if (objectData["type"] == "debugDisplay")
-        newObj = new Objects::DebugDisplay(objectData);
-  
-      view . push_back( newObj );
+      Objects::Object * newObj = makeObject( viewObjects[n] );
+      if ( newObj != NULL )
+        view . push_back( newObj );
     }
 
     Objects::viewList . push_back( view );
@@ -83,6 +97,86 @@ void Objects::loadObjects( Json::Value objects )
   Objects::activeView = &Objects::viewList[0];
 }
 
+void Objects::patchObjects( Json::Value objects )
+{
+  // Brings the views in line with a new configuration. An object whose
+  // data is exactly as it was is kept (so a slideshow doesn't lose its
+  // place), only new and changed objects are made afresh, and the ones
+  // left over are removed.
+  using Objects::viewList;
+  using Objects::activeView;
+
+  Json::Value views = viewsOf( objects );
+
+  // The view on show stays on show, if it's still there
+  size_t activeIndex = 0;
+  bool   ownView     = activeView == NULL;
+  for (size_t i = 0; i < viewList.size(); i++)
+    if ( activeView == &viewList[i] )
+    {
+      activeIndex = i;
+      ownView     = true;
+    }
+
+  Objects::ViewList oldViews;
+  oldViews.swap( viewList );
+
+  int kept = 0;
+  int made = 0;
+  for (size_t viewI = 0; viewI < views.size(); viewI++)
+  {
+    Json::Value   viewObjects = views[ viewI ];
+    Objects::View view;
+
+    for (size_t n = 0; n < viewObjects.size(); n++)
+    {
+      // Objects are matched within the same view, wherever they are in
+      // it, by the hash of their data
+      Objects::Object * newObj = NULL;
+      Resources::Hash   hash   = Resources::hashValue( viewObjects[n] );
+      if ( viewI < oldViews.size() )
+      {
+        Objects::View& oldView = oldViews[ viewI ];
+        for (size_t j = 0; j < oldView.size() and newObj == NULL; j++)
+          if ( oldView[j] != NULL and oldView[j] -> hash() == hash )
+          {
+            newObj     = oldView[j];
+            oldView[j] = NULL;
+            kept++;
+          }
+      }
+
+      if ( newObj == NULL )
+      {
+        newObj = makeObject( viewObjects[n] );
+        made++;
+      }
+
+      if ( newObj != NULL )
+        view . push_back( newObj );
+    }
+
+    viewList . push_back( view );
+  }
+
+  int removed = 0;
+  for (size_t i = 0; i < oldViews.size(); i++)
+    for (size_t j = 0; j < oldViews[i].size(); j++)
+      if ( oldViews[i][j] != NULL )
+      {
+        delete oldViews[i][j];
+        removed++;
+      }
+
+  if ( activeIndex >= viewList.size() )
+    activeIndex = 0;
+  if ( ownView )
+    activeView = &viewList[ activeIndex ];
+
+  Errors::dbg << "Objects: " << kept << " kept, " << made << " new, "
+              << removed << " removed" << endl;
+}
+
 void Objects::updateObjects()
 {
   using Objects::viewList;
@@ -116,7 +210,8 @@ void Objects::removeObjects()
 }
 
 Objects::Object::Object(Json::Value data) :
- self_data( data ), self_x(0), self_y(0), self_w(0), self_h(0)
+ self_data( data ), self_hash( Resources::hashValue( data ) ), 
+ self_x(0), self_y(0), self_w(0), self_h(0)
 {
   Json::Value dimensions = data["dimensions"];
   if ( dimensions.isObject() )
@@ -146,6 +241,16 @@ Objects::Object::Object(Json::Value data) :
   }
 }
 
+Objects::Object::~Object()
+{
+  // Objects are deleted through this base, so their own members go too
+}
+
+Resources::Hash Objects::Object::hash() const
+{
+  return self_hash;
+}
+
 Errors::StreamFork& Objects::Object::err()
 {
   return Errors::err << self_data["type"].asString() << ": ";
@@ -205,6 +310,21 @@ void Objects::Object::update()
   // render function are near useless due to the frequency of the calling.
 }
 
+void Objects::Object::spriteGroups( std::set<string>& groups )
+{
+  // Objects that draw sprites add the groups they use, so that those can
+  // be downloaded first when the object is on show.
+}
+
+std::set<string> Objects::viewSpriteGroups( const Objects::View& view )
+{
+  std::set<string> groups;
+  for ( size_t i = 0; i < view.size(); i++ )
+    view[i] -> spriteGroups( groups );
+
+  return groups;
+}
+
 void Objects::Object::keyHandler(int key)
 {
   // This is a placeholder function, to allow objects to respond to key 
@@ -292,6 +412,11 @@ void Objects::Slideshow::render( double timestamp )
   }
 }
 
+void Objects::Slideshow::spriteGroups( std::set<string>& groups )
+{
+  groups.insert( self_spriteGroup );
+}
+
 void Objects::Slideshow::update()
 {
   using Graphics::sprites;
@@ -354,6 +479,11 @@ Objects::StringDisplay::StringDisplay(Json::Value data) :
   self_lineWidth = data["lineWidth"].asInt();
   self_delimiter = data["delimiter"].asString();
 
+  self_external = data["external"].isBool() and data["external"] == true;
+  if ( self_external )
+    self_strings = Resources::NodeHandle( data["resource"].asString(),
+                                          data["node"].asString() );
+
   // This processes the string data
   this -> update();
 }
@@ -383,32 +513,29 @@ void Objects::StringDisplay::render( double timestamp )
 
 void Objects::StringDisplay::update()
 {
+  // External strings only need redoing once their resource has changed
+  if ( self_external and ! self_strings.stale() )
+    return;
+
   // Make sure repeated calls to this function don't simply add strings
   self_displayStrings.clear();
 
-  Json::Value strings;
-  strings = self_data["strings"];
+  const Json::Value& data = self_data;
+  const Json::Value& strings = self_external ? self_strings.node() 
+                                             : data["strings"];
 
-  if (self_data["external"].isBool())
-    if (self_data["external"] == true)
-    {
-      string resource = self_data["resource"].asString();
-      string node     = self_data["node"].asString();
-      strings = Resources::getResourceNode(resource, node);
-    }
-  
 
   //Create array of human readable strings. New entry every "self_maxLines"
   //lines
   stringstream outputStream;
   int lineN = 0;
-  for (Json::ValueIterator itr = strings.begin(); 
+  for (Json::ValueConstIterator itr = strings.begin(); 
        itr != strings.end(); 
        itr++)
   {
     //Stored as "key" : "value", so extract these
     string key = itr.key().asString();
-    Json::Value value = strings[key];
+    const Json::Value& value = strings[key];
  
     //buffer key and do appropriate thing for value
     outputStream << key << self_delimiter;
@@ -442,6 +569,11 @@ Objects::SpriteDisplay::SpriteDisplay(Json::Value data) :
 
 }
 
+void Objects::SpriteDisplay::spriteGroups( std::set<string>& groups )
+{
+  groups.insert( "__main__" );
+}
+
 void Objects::SpriteDisplay::render( double timestamp )
 {
   Sprite* drawSprite = Graphics::getSprite( self_spriteName );
@@ -556,6 +688,11 @@ void Objects::Gridshow::render( double timestamp )
 
 }
 
+void Objects::Gridshow::spriteGroups( std::set<string>& groups )
+{
+  groups.insert( self_spriteGroup );
+}
+
 void Objects::Gridshow::update()
 {
   using Graphics::sprites;
@@ -617,6 +754,11 @@ Objects::PanSprite::PanSprite( Json::Value data ) :
 
 }
 
+void Objects::PanSprite::spriteGroups( std::set<string>& groups )
+{
+  groups.insert( "__main__" );
+}
+
 void Objects::PanSprite::render( double timestamp )
 {
   using namespace Graphics;
@@ -3,6 +3,7 @@
 
 //Ours
 #include "graphics.h"
+#include "resources.h"
 #include "errors.h"
 
 //JsonCpp
@@ -12,11 +13,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 
 namespace Objects
 {
   void loadObjects(Json::Value objects);
   void updateObjects();
+
+  // Replaces only the objects that differ from the current ones'
+  void patchObjects(Json::Value objects);
   void removeObjects();
 
   enum CoordType { NORM, NON_NORM };
@@ -25,16 +30,22 @@ namespace Objects
   {
     public:
       Object(Json::Value data);
+      virtual ~Object();
       virtual void update();
       virtual void render( double timestamp ) = 0;
+      virtual void spriteGroups( std::set<std::string>& groups );
 
       void keyHandler(int key);
 
+      // Of the data the object was made from
+      Resources::Hash hash() const;
+
       // Personalised output streams
       Errors::StreamFork& err();
       Errors::StreamFork& dbg();
     protected:
       Json::Value self_data;
+      Resources::Hash self_hash;
       double      self_x;
       double      self_y;
       CoordType   self_coordType;
@@ -62,6 +73,8 @@ namespace Objects
       void render( double timestamp );
     private:
       std::vector<std::string> self_displayStrings;
+      Resources::NodeHandle    self_strings;     // If they're external
+      bool                     self_external;
       std::string              self_delimiter;
       int                      self_maxLines;
       int                      self_lineWidth;
@@ -72,6 +85,7 @@ namespace Objects
     public:
       SpriteDisplay(Json::Value data);
       void render( double timestamp );
+      void spriteGroups( std::set<std::string>& groups );
     private:
       std::string self_spriteName;
   };
@@ -82,6 +96,7 @@ namespace Objects
       Slideshow(Json::Value data);
       void update();
       void render( double timestamp );
+      void spriteGroups( std::set<std::string>& groups );
     private:
       double self_lastUpdate;
       double self_timeout;
@@ -96,6 +111,7 @@ namespace Objects
       Gridshow(Json::Value data);
       void update();
       void render( double timestamp );
+      void spriteGroups( std::set<std::string>& groups );
     private:
       int self_cellsWide;
       int self_numCells;
@@ -112,6 +128,7 @@ namespace Objects
     public: 
       PanSprite(Json::Value data);
       void render( double timestamp );
+      void spriteGroups( std::set<std::string>& groups );
     private:
       std::string self_sprite;
 
@@ -148,6 +165,9 @@ namespace Objects
   extern ViewList viewList;
   extern View*    activeView;
 
+  // Every sprite group the objects of a view draw from
+  std::set<std::string> viewSpriteGroups( const View& view );
+
   // Error view - in errors.cpp
   extern View errorView;
   extern View debugView;
@@ -2,6 +2,8 @@
 #include "resources.h"
 #include "boincShare.h"
 #include "networking.h"
+#include "tasks.h"
+#include "cache.h"
 #include "errors.h"
 
 //Json
@@ -12,29 +14,376 @@
 
 //Std
 #include <string>
-#include <fstream>
 #include <iostream>
 #include <map>
+#include <vector>
+#include <cstdlib>
+#include <stdint.h>
 
 using std::string;
-using std::ifstream;
 using std::map;
+using std::vector;
 using std::endl;
 
 Resources::ResourcesMap Resources::resourcesMap;
+Resources::HashMap      Resources::resourceHashes;
 
-Json::Value Resources::getResourceNode( string resourceName, string node )
+// Only the newest load is ever reported, older ones are left to drain
+unsigned int resourceGeneration = 0;
+int          resourceLoadsActive = 0;
+
+// The last parse of each document, by its file on the server. Reused when
+// the server says a document hasn't changed.
+Resources::ResourcesMap parsedDocuments;
+Resources::HashMap      parsedHashes;
+
+// Every change to a live document gives it a new generation, which is how
+// NodeHandles know to look their node up again
+unsigned int documentGeneration = 0;
+map<string, unsigned int> documentGenerations;
+
+void compilePointer( const string& node, vector<string>& path )
+{
+  // Splits a JSON pointer into the keys (or indices) it goes through
+  path.clear();
+  if ( node == "" )
+    return;
+
+  if ( node[0] != '/' )
+  {
+    path.push_back( node );
+    return;
+  }
+
+  size_t start = 1;
+  while ( true )
+  {
+    size_t slash = node.find( '/', start );
+    string token = node.substr( start, slash == string::npos ? 
+                                       string::npos : slash - start );
+
+    // ~1 before ~0, so "~01" is "~1" rather than "/"
+    size_t escape;
+    while ( ( escape = token.find( "~1" ) ) != string::npos )
+      token.replace( escape, 2, "/" );
+    while ( ( escape = token.find( "~0" ) ) != string::npos )
+      token.replace( escape, 2, "~" );
+    path.push_back( token );
+
+    if ( slash == string::npos )
+      break;
+    start = slash + 1;
+  }
+}
+
+const Json::Value& findNode( const Json::Value& document, 
+                             const vector<string>& path )
+{
+  // Only the const accessors are used, which never add anything
+  const Json::Value* node = &document;
+  for ( size_t i = 0; i < path.size(); i++ )
+  {
+    const string& token = path[i];
+    if ( node -> isObject() and node -> isMember( token ) )
+    {
+      node = &( (*node)[ token ] );
+      continue;
+    }
+
+    // Array elements by index
+    if ( node -> isArray() and token != "" and 
+         token.find_first_not_of( "0123456789" ) == string::npos )
+    {
+      Json::Value::UInt index = strtoul( token.c_str(), NULL, 10 );
+      if ( index < node -> size() )
+      {
+        node = &( (*node)[ index ] );
+        continue;
+      }
+    }
+
+    return Json::Value::null;
+  }
+
+  return *node;
+}
+
+const Json::Value& Resources::getResourceNode( string resourceName, 
+                                               string node )
+{
+  return Resources::getResourceNode( Resources::resourcesMap, 
+                                     resourceName, node );
+}
+
+const Json::Value& Resources::getResourceNode( 
+                                     const ResourcesMap& resources,
+                                     string resourceName, string node )
 {
-  return Resources::resourcesMap[ resourceName ][ node ];
+  // The documents needn't be the live ones
+  ResourcesMap::const_iterator resource = resources.find( resourceName );
+  if ( resource == resources.end() )
+    return Json::Value::null;
+
+  vector<string> path;
+  compilePointer( node, path );
+  return findNode( resource -> second, path );
+}
+
+Resources::NodeHandle::NodeHandle() :
+  self_generation(0), self_node(NULL) {}
+
+Resources::NodeHandle::NodeHandle( string resourceName, string node ) :
+  self_resourceName( resourceName ), self_generation(0), self_node(NULL)
+{
+  compilePointer( node, self_path );
+}
+
+bool Resources::NodeHandle::stale()
+{
+  // A document that has never been live has no generation, so a handle to
+  // it is looked up every time
+  map<string, unsigned int>::iterator generation;
+  generation = documentGenerations.find( self_resourceName );
+  return self_generation == 0 or 
+         generation == documentGenerations.end() or
+         generation -> second != self_generation;
+}
+
+const Json::Value& Resources::NodeHandle::node()
+{
+  if ( this -> stale() )
+  {
+    map<string, unsigned int>::iterator generation;
+    generation = documentGenerations.find( self_resourceName );
+    self_generation = 0;
+    if ( generation != documentGenerations.end() )
+      self_generation = generation -> second;
+
+    Resources::ResourcesMap::iterator document;
+    document = Resources::resourcesMap.find( self_resourceName );
+    if ( document == Resources::resourcesMap.end() )
+      self_node = &Json::Value::null;
+    else
+      self_node = &findNode( document -> second, self_path );
+  }
+
+  return *self_node;
 }
 
-Resources::ResourcesMap Resources::loadResources( Json::Value resources )
+void Resources::publish( const Resources::ResourcesMap& newResources, 
+                         const Resources::HashMap& newHashes )
+{
+  using Resources::resourcesMap;
+  using Resources::resourceHashes;
+
+  // Documents that have gone
+  Resources::ResourcesMap::iterator document = resourcesMap.begin();
+  while ( document != resourcesMap.end() )
+  {
+    if ( newResources.find( document -> first ) == newResources.end() )
+    {
+      documentGenerations[ document -> first ] = ++documentGeneration;
+      resourcesMap.erase( document++ );
+    }
+    else
+      document++;
+  }
+
+  // New and changed ones. Those left as they were keep their nodes where
+  // they are, so handles to them stay good.
+  Resources::ResourcesMap::const_iterator newDocument;
+  for ( newDocument  = newResources.begin(); 
+        newDocument != newResources.end(); newDocument++ )
+  {
+    const string& name = newDocument -> first;
+    Resources::HashMap::const_iterator newHash, oldHash;
+    newHash = newHashes.find( name );
+    oldHash = resourceHashes.find( name );
+    if ( resourcesMap.find( name ) != resourcesMap.end() and
+         newHash != newHashes.end() and oldHash != resourceHashes.end() and
+         newHash -> second == oldHash -> second )
+      continue;
+
+    resourcesMap[ name ] = newDocument -> second;
+    documentGenerations[ name ] = ++documentGeneration;
+  }
+
+  resourceHashes = newHashes;
+}
+
+Resources::Hash Resources::hashValue( const Json::Value& value )
+{
+  // Containers are hashed from their members' hashes, so each node is
+  // only visited once. Members come out of JsonCpp sorted by key.
+  Resources::Hash hash = Cache::hashSeed;
+  unsigned char type = value.type();
+  Cache::hashUpdate( hash, &type, 1 );
+
+  switch ( value.type() )
+  {
+    case Json::nullValue:
+      break;
+    case Json::intValue:
+    {
+      Json::Int number = value.asInt();
+      Cache::hashUpdate( hash, &number, sizeof(number) );
+      break;
+    }
+    case Json::uintValue:
+    {
+      Json::UInt number = value.asUInt();
+      Cache::hashUpdate( hash, &number, sizeof(number) );
+      break;
+    }
+    case Json::realValue:
+    {
+      double number = value.asDouble();
+      Cache::hashUpdate( hash, &number, sizeof(number) );
+      break;
+    }
+    case Json::stringValue:
+    {
+      string text = value.asString();
+      Cache::hashUpdate( hash, text.data(), text.size() );
+      break;
+    }
+    case Json::booleanValue:
+    {
+      unsigned char truth = value.asBool();
+      Cache::hashUpdate( hash, &truth, 1 );
+      break;
+    }
+    case Json::arrayValue:
+      for ( Json::Value::UInt i = 0; i < value.size(); i++ )
+      {
+        Resources::Hash element = Resources::hashValue( value[i] );
+        Cache::hashUpdate( hash, &element, sizeof(element) );
+      }
+      break;
+    case Json::objectValue:
+      for ( Json::ValueConstIterator itr = value.begin(); 
+            itr != value.end(); itr++ )
+      {
+        // The terminating null keeps "ab":x and "a":"bx" apart
+        string key = itr.key().asString();
+        Cache::hashUpdate( hash, key.c_str(), key.size() + 1 );
+        Resources::Hash member = Resources::hashValue( *itr );
+        Cache::hashUpdate( hash, &member, sizeof(member) );
+      }
+      break;
+  }
+
+  return hash;
+}
+
+void finishLoad( Resources::ResourceLoad* load )
+{
+  resourceLoadsActive--;
+
+  if ( load -> generation == resourceGeneration )
+    (*(load -> loaded))( load -> newResources, load -> newHashes,
+                         load -> userData );
+
+  delete load;
+}
+
+bool Resources::parseDocument( const string& buffer, Json::Value& document )
+{
+  // Parsing from the buffer's own memory, rather than through a stream,
+  // saves JsonCpp taking another copy of the whole document.
+  const char* begin = buffer.data();
+  const char* end   = begin + buffer.size();
+
+  Json::Reader reader;
+  return reader.parse( begin, end, document );
+}
+
+void parseResource( void* data )
+{
+  // Worker thread - only touches the fetch itself
+  Resources::ResourceFetch* fetch = (Resources::ResourceFetch*) data;
+  fetch -> parsed = Resources::parseDocument( fetch -> buffer, 
+                                              fetch -> resource );
+  if ( fetch -> parsed )
+    fetch -> hash = Resources::hashValue( fetch -> resource );
+}
+
+void resourceParsed( void* data )
+{
+  Resources::ResourceFetch* fetch = (Resources::ResourceFetch*) data;
+  Resources::ResourceLoad*  load  = fetch -> load;
+
+  if ( fetch -> parsed )
+  {
+    // Save in memory
+    load -> newResources[ fetch -> resourceName ] = fetch -> resource;
+    load -> newHashes[ fetch -> resourceName ]    = fetch -> hash;
+    parsedDocuments[ fetch -> netFilename ] = fetch -> resource;
+    parsedHashes[ fetch -> netFilename ]    = fetch -> hash;
+  }
+  else
+  {
+    Errors::err << "Provided JSON file " << fetch -> netFilename
+                << " is invalid JSON." << endl 
+                << fetch -> resourceName << " will not be loaded." << endl;
+  }
+
+  delete fetch;
+
+  load -> pending--;
+  if ( load -> pending == 0 )
+    finishLoad( load );
+}
+
+void resourceDownloaded( CURL* easyHandle, void* data )
+{
+  // Parsing can take a while for big documents, so it goes to a worker
+  Tasks::post( &parseResource, &resourceParsed, data );
+}
+
+void resourceUnchanged( CURL* easyHandle, void* data )
+{
+  // The server still has what we last parsed, so skip parsing it again
+  Resources::ResourceFetch* fetch = (Resources::ResourceFetch*) data;
+
+  Resources::ResourcesMap::iterator document;
+  document = parsedDocuments.find( fetch -> netFilename );
+  if ( document == parsedDocuments.end() )
+  {
+    // Not parsed in this session, so parse the cached copy
+    using Networking::fileDownloader;
+    string url = fileDownloader -> pathFromString( fetch -> netFilename );
+    Cache::restoreBytes( url, fetch -> buffer );
+    resourceDownloaded( easyHandle, data );
+    return;
+  }
+
+  fetch -> resource = document -> second;
+  fetch -> hash     = parsedHashes[ fetch -> netFilename ];
+  fetch -> parsed   = true;
+  resourceParsed( fetch );
+}
+
+void Resources::loadResources( Json::Value resources, 
+                               Resources::loadedFunc loaded, 
+                               void* userData )
 {
   using namespace Networking;
 
-  ResourcesMap newResourceMap;
+  Resources::ResourceLoad* load = new Resources::ResourceLoad;
+  load -> pending    = resources.size();
+  load -> generation = ++resourceGeneration;
+  load -> loaded     = loaded;
+  load -> userData   = userData;
+  resourceLoadsActive++;
+
+  if ( load -> pending == 0 )
+  {
+    finishLoad( load );
+    return;
+  }
 
-  // Provided are (name, file) pairs, so load them in
+  // Provided are (name, file) pairs, so queue them all up
   for (Json::ValueIterator itr  = resources.begin(); 
                            itr != resources.end(); 
                            itr++)
@@ -42,25 +391,24 @@ Resources::ResourcesMap Resources::loadResources( Json::Value resources )
     string resourceName = itr.key().asString();
     string netResourceFilename = resources[ resourceName ].asString();
 
-    // Download file
-    string localFilename = fileDownloader->getFile(netResourceFilename);
-    ifstream resourceFile( localFilename . c_str() );
+    Resources::ResourceFetch* fetch = new Resources::ResourceFetch;
+    fetch -> load          = load;
+    fetch -> resourceName  = resourceName;
+    fetch -> netFilename   = netResourceFilename;
+    fetch -> hash          = 0;
+    fetch -> parsed        = false;
 
-    // Parse
-    Json::Value resource;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse( resourceFile, resource );
-    if (!parsingSuccessful)
-    {
-      Errors::err << "Provided JSON file " << localFilename
-                  << "is invalid JSON." << endl 
-                  << resourceName << " will not be loaded." << endl;
-      continue;
-    }
-
-    // Save in memory
-    newResourceMap[ resourceName ] = resource;
+    FileInformation resourceInfo;
+    resourceInfo . finishResponse    = &resourceDownloaded;
+    resourceInfo . unchangedResponse = &resourceUnchanged;
+    resourceInfo . memorySink        = &( fetch -> buffer );
+    resourceInfo . userData          = fetch;
+    resourceInfo . priority          = Networking::CONTROL;
+    fileDownloader -> addFile( netResourceFilename, resourceInfo );
   }
+}
 
-  return newResourceMap;
+bool Resources::loading()
+{
+  return resourceLoadsActive > 0;
 }
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <stdint.h>
 
 #include "json/json.h"
 
@@ -10,9 +12,88 @@ namespace Resources
 {
   typedef std::map<std::string, Json::Value> ResourcesMap;
   extern ResourcesMap resourcesMap;
-  Json::Value getResourceNode(std::string resourceName, std::string node);
+
+  // A node is named by a JSON pointer into the document ("/a/b/0", ~1 for
+  // a / in a key and ~0 for a ~), or just by the key of one of its members
+  // as "node" always has been. Missing nodes are null, nothing is ever
+  // added to the document looking for them.
+  const Json::Value& getResourceNode(std::string resourceName, 
+                                     std::string node);
+  const Json::Value& getResourceNode(const ResourcesMap& resources, 
+                                     std::string resourceName, 
+                                     std::string node);
+
+  // A node of a live document, for something that uses it repeatedly. The
+  // pointer is parsed once, and the node looked up the first time it's
+  // wanted and again only once its document has changed.
+  class NodeHandle
+  {
+    public:
+      NodeHandle();
+      NodeHandle(std::string resourceName, std::string node);
+
+      const Json::Value& node();
+
+      // Whether the node may have changed since node() was last called
+      bool stale();
+    private:
+      std::string              self_resourceName;
+      std::vector<std::string> self_path;
+
+      // The document's generation when the node was looked up, 0 if never
+      unsigned int             self_generation;
+      const Json::Value*       self_node;
+  };
+
+  // Structural hash of a document or any part of one - 64 bit FNV-1a over
+  // its types, keys and values, so formatting and member order make no
+  // difference. Equal hashes are taken to mean equal values, which saves
+  // walking both trees to compare them.
+  typedef uint64_t Hash;
+  typedef std::map<std::string, Hash> HashMap;
+  Hash hashValue( const Json::Value& value );
+
+  // The hash of each document in resourcesMap, worked out as it was parsed
+  extern HashMap resourceHashes;
+
+  // Makes newResources the live documents. Only those that differ (by 
+  // hash) are replaced, so handles to the others stay as they are.
+  void publish(const ResourcesMap& newResources, const HashMap& newHashes);
+
+  // Called on the render thread once every document of a load is ready
+  typedef void (*loadedFunc)( ResourcesMap& newResources, 
+                              HashMap& newHashes, void* userData );
+
+  // A single loadResources() call. Every document is downloaded at once
+  // and parsed on a worker thread, the finished map is only handed to 
+  // loaded() when the last one is in.
+  struct ResourceLoad
+  {
+    ResourcesMap newResources;
+    HashMap      newHashes;
+    int          pending;
+    unsigned int generation;
+    loadedFunc   loaded;
+    void*        userData;
+  };
+
+  struct ResourceFetch
+  {
+    ResourceLoad* load;
+    std::string   resourceName;
+    std::string   netFilename;
+    std::string   buffer;
+    Json::Value   resource;
+    Hash          hash;
+    bool          parsed;
+  };
   
-  ResourcesMap loadResources(Json::Value resources);
+  void loadResources(Json::Value resources, loadedFunc loaded, 
+                     void* userData);
+  bool loading();
+
+  // Parses a document straight out of a download buffer
+  bool parseDocument( const std::string& buffer, Json::Value& document );
 };
 
 #endif //Include guard
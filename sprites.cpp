@@ -10,6 +10,8 @@
 #include "boincShare.h"
 #include "networking.h"
 #include "resources.h"
+#include "cache.h"
+#include "tasks.h"
 #include "errors.h"
 
 //JsonCPP
@@ -21,6 +23,7 @@
 
 //Standard
 #include <map>
+#include <set>
 #include <iostream>
 #include <cstdlib>
 #include <sstream>
@@ -34,6 +37,43 @@ using std::out_of_range;
 using std::string;
 
 Graphics::spriteGroupMap Graphics::sprites;
+Graphics::spriteGroupMap Graphics::pendingSprites;
+
+// Sprite pipeline state (see graphics.h)
+Graphics::SpriteLoadMap      spriteDownloads;
+Graphics::DecodedSpriteQueue decodedSprites;
+
+// Every Sprite either set uses, and those made from files by their key
+// (see spriteKey())
+Graphics::SpriteCache        spriteCache;
+Graphics::SpriteCacheIndex   spriteCacheIndex;
+
+// The hash of each group's definition, for each set, so that unchanged 
+// groups can be carried over rather than loaded again
+Resources::HashMap liveGroupHashes;
+Resources::HashMap pendingGroupHashes;
+unsigned int spriteGeneration = 0;
+int          spriteDownloadsPending = 0;
+bool         spriteLoadActive = false;
+
+// Groups the active view draws from, see prioritiseSprites()
+std::set<string> urgentSpriteGroups;
+
+// Textures are uploaded to GL on the render thread, so only a few are done
+// per frame to stop a big reload from causing a visible stall.
+const size_t spriteUploadsPerFrame = 2;
+
+Networking::Priority spritePriority( const Graphics::SpriteLoad* load )
+{
+  for (size_t i = 0; i < load -> targets.size(); i++)
+  {
+    const string& group = load -> targets[i].groupName;
+    if ( urgentSpriteGroups.find( group ) != urgentSpriteGroups.end() )
+      return Networking::ACTIVE;
+  }
+
+  return Networking::PREFETCH;
+}
 
 bool isPowerOfTwo(int x){ return  (x != 0) && ((x & (x-1)) == 0); }
 
@@ -45,6 +85,12 @@ Graphics::Sprite* Graphics::getSprite(string groupName, string spriteName)
 {
   Graphics::spriteGroupMap::iterator groupItr = 
                                           Graphics::sprites.find(groupName);
+
+  // Whilst a load is in flight missing sprites are expected, so quietly
+  // hand back something safe to draw.
+  if (groupItr == Graphics::sprites.end() and spriteLoadActive)
+    return Graphics::placeholderSprite();
+
   if (groupItr == Graphics::sprites.end())
   {
     Errors::err << "The requested group \"" << groupName 
@@ -54,6 +100,9 @@ Graphics::Sprite* Graphics::getSprite(string groupName, string spriteName)
 
   Graphics::spriteGroup::iterator spriteItr = groupItr 
                                              -> second . find(spriteName);
+  if (spriteItr == groupItr -> second.end() and spriteLoadActive)
+    return Graphics::placeholderSprite();
+
   if (spriteItr == groupItr -> second.end())
   {
     Errors::err << "The requested sprite \"" << spriteName 
@@ -69,6 +118,20 @@ Graphics::Sprite* Graphics::getSprite(string spriteName)
   return Graphics::getSprite("__main__", spriteName);
 }
 
+Graphics::Sprite* Graphics::placeholderSprite()
+{
+  // An untextured 1x1 sprite, drawn in place of sprites that are still
+  // downloading. It is made on first use as it needs a GL context.
+  static Graphics::Sprite* placeholder = NULL;
+  if (placeholder == NULL)
+  {
+    placeholder = new Graphics::Sprite();
+    placeholder -> self_imageWidth  = 1;
+    placeholder -> self_imageHeight = 1;
+  }
+  return placeholder;
+}
+
 ////////////////////////
 //Sprite Class Methods//
 ////////////////////////
@@ -91,6 +154,14 @@ Graphics::Sprite::Sprite(string filename)
   bool hasAlpha;
   GLubyte* texturePointer;
 
+  self_texture = 0;
+  self_textureWidth = 0;
+  self_textureHeight = 0;
+  self_imageWidth = 0;
+  self_imageHeight = 0;
+  self_textureHasAlpha = false;
+  self_textureTarget = GL_TEXTURE_2D;
+
   //Load the image
   bool successfulLoad = false;
   size_t fileExtensionPos = filename.find_last_of(".") + 1;
@@ -111,6 +182,22 @@ Graphics::Sprite::Sprite(string filename)
     return;
   }
 
+  this -> upload( width, height, hasAlpha, texturePointer );
+  free( texturePointer );
+}
+
+Graphics::Sprite::Sprite(int width, int height, bool hasAlpha, 
+                         GLubyte* pixels)
+{
+  // Builds a sprite from already decoded pixel data (bottom row first, as
+  // loadPng produces it). The caller keeps ownership of the pixels.
+  self_texture = 0;
+  this -> upload( width, height, hasAlpha, pixels );
+}
+
+void Graphics::Sprite::upload(int width, int height, bool hasAlpha, 
+                              GLubyte* texturePointer)
+{
   //Set up normal parameters
   self_imageWidth    = width;
   self_imageHeight   = height;
@@ -164,9 +251,8 @@ Graphics::Sprite::Sprite(string filename)
   glTexParameterf(self_textureTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameterf(self_textureTarget, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-  // OpenGL has made it's own copy of the image data, so we're free to get
-  // rid of it.
-  free( texturePointer );
+  // OpenGL has made it's own copy of the image data, so the caller is free
+  // to get rid of it.
 }
 
 Graphics::Sprite::~Sprite()
@@ -296,15 +382,365 @@ void Graphics::Sprite::blit( int xScr, int yScr, int wScr, int hScr,
 // Sprite Loader //
 ///////////////////
 
-void Graphics::loadSprites(Json::Value sprites)
+void spriteChunk( const char* data, size_t size, void* stream )
+{
+  // Network thread - PNGs are decoded as they download
+  if ( data == NULL )
+    Graphics::resetPng( (Graphics::PngStream*) stream );
+  else
+    Graphics::feedPng( (Graphics::PngStream*) stream, data, size );
+}
+
+string spriteKey( const string& offsiteFilename, const string& hash )
+{
+  // Sprites whose file's content isn't known can't be found again
+  if ( hash == "" )
+    return "";
+
+  using Networking::fileDownloader;
+  return fileDownloader -> pathFromString( offsiteFilename ) + " " + hash;
+}
+
+Graphics::Sprite* findSprite( const string& key )
+{
+  Graphics::SpriteCacheIndex::iterator cached;
+  cached = spriteCacheIndex.find( key );
+  if ( key == "" or cached == spriteCacheIndex.end() )
+    return NULL;
+  return cached -> second;
+}
+
+string cachedHash( const Graphics::SpriteLoad* load )
+{
+  using Networking::fileDownloader;
+  Cache::Entry entry;
+  if ( ! Cache::lookup( fileDownloader -> pathFromString( 
+                                     load -> offsiteFilename ), entry ) )
+    return "";
+  return entry.hash;
+}
+
+void decodeSprite( void* data )
+{
+  // Worker thread - the file is read and decoded here, never on the
+  // render thread
+  Graphics::DecodedSprite* decoded = (Graphics::DecodedSprite*) data;
+  decoded -> decoded = Graphics::loadPng( decoded -> localFilename,
+                                          decoded -> width, 
+                                          decoded -> height,
+                                          decoded -> hasAlpha, 
+                                          &decoded -> pixels );
+}
+
+void spriteDecoded( void* data )
+{
+  // Passes a worker's decode on to processSprites(), unless a newer 
+  // loadSprites() has come along in the meantime
+  Graphics::DecodedSprite* decoded = (Graphics::DecodedSprite*) data;
+  if ( decoded -> generation != spriteGeneration )
+  {
+    free( decoded -> pixels );
+    delete decoded;
+    return;
+  }
+
+  if ( ! decoded -> decoded )
+    Errors::err << "Error loading texture file." << endl
+                << "Filename: " << decoded -> localFilename << endl;
+
+  decodedSprites.push_back( *decoded );
+  spriteDownloadsPending--;
+  delete decoded;
+}
+
+void spriteDownloaded( CURL* easyHandle, void* data )
+{
+  // Finish and unchanged response for sprite downloads. A file whose
+  // content is already in the sprite cache is used from there, otherwise
+  // this takes the image decoded as it arrived and passes it on to be
+  // uploaded by processSprites(). If none was (it wasn't modified, or
+  // came from the cache) a worker decodes the file first.
+  Graphics::SpriteLoad* load = (Graphics::SpriteLoad*) data;
+  spriteDownloads.erase( load -> offsiteFilename );
+
+  // A newer loadSprites() has superseded this download
+  if ( load -> generation != spriteGeneration )
+  {
+    Graphics::endPng( load -> stream );
+    delete load;
+    return;
+  }
+
+  Graphics::DecodedSprite decoded;
+  decoded.targets         = load -> targets;
+  decoded.offsiteFilename = load -> offsiteFilename;
+  decoded.localFilename   = load -> localFilename;
+  decoded.hash            = cachedHash( load );
+  decoded.generation      = load -> generation;
+  decoded.resident        = findSprite( spriteKey( decoded.offsiteFilename,
+                                                 decoded.hash ) );
+  decoded.pixels          = NULL;
+  decoded.decoded         = decoded.resident != NULL;
+  if ( ! decoded.decoded and load -> stream != NULL )
+    decoded.decoded = Graphics::finishPng( load -> stream, 
+                                           decoded.width, decoded.height,
+                                           decoded.hasAlpha, 
+                                           &decoded.pixels );
+  Graphics::endPng( load -> stream );
+  delete load;
+
+  // Still counted as pending until the worker is done with it
+  if ( ! decoded.decoded )
+  {
+    Tasks::post( &decodeSprite, &spriteDecoded, 
+                 new Graphics::DecodedSprite( decoded ) );
+    return;
+  }
+
+  decodedSprites.push_back( decoded );
+  spriteDownloadsPending--;
+}
+
+void holdSprite( Graphics::Sprite* sprite, const string& key )
+{
+  Graphics::SpriteCache::iterator cached = spriteCache.find( sprite );
+  if ( cached == spriteCache.end() )
+  {
+    Graphics::CachedSprite entry;
+    entry.references = 0;
+    cached = spriteCache.insert( std::make_pair( sprite, entry ) ).first;
+  }
+
+  if ( key != "" and cached -> second.key == "" and
+       spriteCacheIndex.find( key ) == spriteCacheIndex.end() )
+  {
+    cached -> second.key = key;
+    spriteCacheIndex[ key ] = sprite;
+  }
+
+  cached -> second.references++;
+}
+
+void placeSprite( Graphics::spriteGroupMap& groups, 
+                  const Graphics::SpriteTarget& target,
+                  Graphics::Sprite* sprite, const string& key )
+{
+  // Gives sprite a name in groups, releasing whatever had it before
+  Graphics::Sprite*& slot = groups[ target.groupName ][ target.spriteName ];
+  if ( slot != NULL )
+    spriteCache[ slot ].references--;
+
+  slot = sprite;
+  holdSprite( sprite, key );
+}
+
+void releaseSprites( Graphics::spriteGroupMap& groups )
+{
+  // Drops the references groups holds and empties it. Nothing is deleted
+  // until evictSprites().
+  Graphics::spriteGroupMap::iterator groupItr;
+  Graphics::spriteGroup::iterator    spriteItr;
+  for (groupItr = groups.begin(); groupItr != groups.end(); groupItr++)
+    for (spriteItr  = groupItr -> second.begin();
+         spriteItr != groupItr -> second.end(); spriteItr++)
+      spriteCache[ spriteItr -> second ].references--;
+
+  groups.clear();
+}
+
+void evictSprites()
+{
+  // Deletes every Sprite neither set refers to any more
+  int evicted = 0;
+  Graphics::SpriteCache::iterator cached = spriteCache.begin();
+  while ( cached != spriteCache.end() )
+  {
+    if ( cached -> second.references > 0 )
+    {
+      cached++;
+      continue;
+    }
+
+    if ( cached -> second.key != "" )
+      spriteCacheIndex.erase( cached -> second.key );
+    delete cached -> first;
+    spriteCache.erase( cached++ );
+    evicted++;
+  }
+
+  if ( evicted > 0 )
+    Errors::dbg << "Sprite cache: " << evicted << " evicted, " 
+                << spriteCache.size() << " held" << endl;
+}
+
+void spriteEntry( const Json::Value& spriteData, size_t i, 
+                  string& offsiteFilename, string& internalName )
+{
+  //Get the sprite info
+  //(Currently just file and possibly name - room for future expansion)
+
+  //Accepted type 1 - just a string of the filename
+  if (spriteData.isString())
+  {
+    offsiteFilename = spriteData.asString();
+
+    //Internal naming for nameless sprites is __NUM__ where NUM depends
+    //on the order of loading
+    stringstream spriteNameStream;
+    spriteNameStream << "__" << i << "__";
+    internalName = spriteNameStream.str();
+  }
+  //Accepted type 2 - object containing more data
+  else if(spriteData.isObject())
+  {
+    offsiteFilename = spriteData["file"].asString();
+    internalName    = spriteData["name"].asString();
+  }
+}
+
+void carryGroup( const string& groupName )
+{
+  // A group defined as the live one was is used as it is, Sprites and all
+  Graphics::spriteGroup& group = Graphics::sprites[ groupName ];
+  Graphics::pendingSprites[ groupName ];
+
+  for (Graphics::spriteGroup::iterator itr = group.begin(); 
+       itr != group.end(); itr++)
+  {
+    Graphics::SpriteTarget target;
+    target.groupName  = groupName;
+    target.spriteName = itr -> first;
+    placeSprite( Graphics::pendingSprites, target, itr -> second, "" );
+  }
+}
+
+void forgetSpriteFiles( const std::set<string>& urls )
 {
+  // Sprites made from these files are out of date, so mustn't be found
+  // by them again. They carry on being drawn until replaced.
+  Graphics::SpriteCache::iterator cached = spriteCache.begin();
+  for ( ; cached != spriteCache.end(); cached++ )
+  {
+    string& key = cached -> second.key;
+    if ( key == "" or urls.count( key.substr( 0, key.rfind( ' ' ) ) ) == 0 )
+      continue;
+
+    spriteCacheIndex.erase( key );
+    key = "";
+  }
+}
+
+void queueSprite( const string& offsiteFilename, 
+                  const Graphics::SpriteTarget& target )
+{
+  // One download per file, however many sprites are made from it. A
+  // download still in flight from an older load is adopted, rather than
+  // having two transfers writing the same local file.
+  Graphics::SpriteLoadMap::iterator loadItr;
+  loadItr = spriteDownloads.find( offsiteFilename );
+  if ( loadItr != spriteDownloads.end() )
+  {
+    Graphics::SpriteLoad* load = loadItr -> second;
+    if ( load -> generation != spriteGeneration )
+    {
+      load -> generation = spriteGeneration;
+      load -> targets.clear();
+      spriteDownloadsPending++;
+    }
+    load -> targets.push_back( target );
+    return;
+  }
+
+  Graphics::SpriteLoad* load = new Graphics::SpriteLoad;
+  load -> offsiteFilename = offsiteFilename;
+  load -> localFilename   = "./dispFiles/" + offsiteFilename;
+  load -> generation      = spriteGeneration;
+  load -> stream          = NULL;
+  load -> targets.push_back( target );
+  spriteDownloads[ offsiteFilename ] = load;
+  spriteDownloadsPending++;
+
+  using Networking::fileDownloader;
+  using Networking::FileInformation;
+  FileInformation spriteInfo;
+  spriteInfo . finishResponse    = &spriteDownloaded;
+  spriteInfo . unchangedResponse = &spriteDownloaded;
+  spriteInfo . userData          = load;
+  spriteInfo . priority          = spritePriority( load );
+
+  // Only PNGs are decoded (see Sprite::Sprite), so only they stream
+  size_t extension = offsiteFilename.find_last_of( "." );
+  if ( extension != string::npos and 
+       offsiteFilename.substr( extension + 1 ) == "png" )
+  {
+    load -> stream          = Graphics::beginPng();
+    spriteInfo . streamFunc = &spriteChunk;
+    spriteInfo . streamData = load -> stream;
+  }
+
+  load -> requestId = fileDownloader -> addFile( offsiteFilename, 
+                                                 spriteInfo );
+}
+
+void Graphics::loadSprites(Json::Value sprites, 
+                           const Resources::ResourcesMap& resources,
+                           const std::set<string>& changedFiles)
+{
+  // resources are those of the scene the sprites are for, which needn't
+  // be live yet. changedFiles are the URLs of files known to differ from
+  // what was last fetched.
   if (sprites["external"].isBool())
     if (sprites["external"] == true)
     {
       string resource = sprites["resource"].asString();
       string node = sprites["node"].asString();
-      sprites = Resources::getResourceNode(resource, node);
+      sprites = Resources::getResourceNode(resources, resource, node);
+    }
+
+  // Groups drawing on a changed file need it again, even if they are
+  // defined as they were
+  using Networking::fileDownloader;
+  Resources::HashMap groupHashes;
+  std::set<string> staleGroups;
+  for (Json::ValueIterator itr = sprites.begin(); 
+       itr != sprites.end();
+       itr++)
+  {
+    string groupName = itr.key().asString();
+    groupHashes[ groupName ] = Resources::hashValue( *itr );
+
+    for (size_t i = 0; i < (*itr).size() and ! changedFiles.empty(); i++)
+    {
+      string offsiteFilename;
+      string internalName;
+      spriteEntry( (*itr)[i], i, offsiteFilename, internalName );
+      if ( changedFiles.count( 
+                 fileDownloader -> pathFromString( offsiteFilename ) ) )
+        staleGroups.insert( groupName );
     }
+  }
+  forgetSpriteFiles( changedFiles );
+
+  // Nothing to do if these are the sprites already there, or on the way
+  if ( staleGroups.empty() and 
+       groupHashes == ( spriteLoadActive ? pendingGroupHashes 
+                                         : liveGroupHashes ) )
+    return;
+
+  // Start a new generation, throwing away anything a previous, unfinished
+  // load had already uploaded.
+  spriteGeneration++;
+  releaseSprites( Graphics::pendingSprites );
+  for (size_t i = 0; i < decodedSprites.size(); i++)
+    free( decodedSprites[i].pixels );
+  decodedSprites.clear();
+  spriteDownloadsPending = 0;
+  spriteLoadActive = true;
+  pendingGroupHashes = groupHashes;
+
+  int groupsKept = 0;
+  int groupsLoaded = 0;
+  int filesRefreshed = 0;
   
   //Loads a series of sprite groups.
   for (Json::ValueIterator itr = sprites.begin(); 
@@ -314,75 +750,144 @@ void Graphics::loadSprites(Json::Value sprites)
     //Get and iterate over the group
     string groupName = itr.key().asString();
     Json::Value group = sprites[groupName];
+
+    // Only groups that have changed are loaded. The rest are carried 
+    // over, bar the sprites of changed files, which replace theirs once
+    // they arrive.
+    Resources::HashMap::iterator live = liveGroupHashes.find( groupName );
+    bool kept = live != liveGroupHashes.end() and 
+                live -> second == groupHashes[ groupName ];
+    if ( kept )
+    {
+      carryGroup( groupName );
+      groupsKept++;
+    }
+    else
+      groupsLoaded++;
+
+    if ( kept and staleGroups.count( groupName ) == 0 )
+      continue;
+
     for (size_t i = 0; i < group.size(); i++)
     {
-      //Get the sprite info
-      //(Currently just file and possibly name - room for future expansion)
-      Json::Value spriteData = group[i];
       string offsiteFilename;
       string internalName;
+      spriteEntry( group[i], i, offsiteFilename, internalName );
+
+      string url = fileDownloader -> pathFromString( offsiteFilename );
+      if ( kept and changedFiles.count( url ) == 0 )
+        continue;
+      if ( kept )
+        filesRefreshed++;
+
+      Graphics::SpriteTarget target;
+      target.groupName  = groupName;
+      target.spriteName = internalName;
+      queueSprite( offsiteFilename, target );
+    }
+  }
 
-      //Accepted type 1 - just a string of the filename
-      if (spriteData.isString())
-      {
-        offsiteFilename = spriteData.asString();
-
-        //Internal naming for nameless sprites is __NUM__ where NUM depends
-        //on the order of loading
-        stringstream spriteNameStream;
-        spriteNameStream << "__" << i << "__";
-        internalName = spriteNameStream.str();
-      }
-      //Accepted type 2 - object containing more data
-      else if(spriteData.isObject())
-      {
-        offsiteFilename = spriteData["file"].asString();
-        internalName    = spriteData["name"].asString();
-      }
-
-      //Get the file from offsite
-      //NOTE - synchronous call, potential for blocking
-      using namespace Networking;
-      string localFilename = fileDownloader->getFile( offsiteFilename );
-
-      //Try to create a new sprite
-      //NOTE - Sprites are loaded with no thought to their lifetime
-      Graphics::Sprite* newSprite = new Graphics::Sprite( localFilename );
-      if ( newSprite == NULL )
-        Errors::err << "Sprite for " << localFilename << " was created NULL"
-                    << endl;
-      
-      //Add sprite to group it's respective group with appropriate name
-      Graphics::sprites[ groupName ][ internalName ] = newSprite;
-
-      }
+  Errors::dbg << "Sprites: " << groupsKept << " groups kept, " 
+              << groupsLoaded << " loading, " << filesRefreshed 
+              << " sprites of changed files refreshed" << endl;
+}
+
+void Graphics::prioritiseSprites(const std::set<string>& groups)
+{
+  // Called when the active view changes. Downloads still in flight are
+  // moved up or down to match.
+  urgentSpriteGroups = groups;
+
+  using Networking::fileDownloader;
+  for (Graphics::SpriteLoadMap::iterator itr = spriteDownloads.begin();
+       itr != spriteDownloads.end(); 
+       itr++)
+  {
+    Graphics::SpriteLoad* load = itr -> second;
+    fileDownloader -> reprioritise( load -> requestId, 
+                                    spritePriority( load ) );
   }
 }
 
-void Graphics::removeSprites()
+bool Graphics::processSprites()
 {
-  using Graphics::sprites;
-  using Graphics::spriteGroupMap;
-  using Graphics::spriteGroup;
+  // Called every frame. Uploads decoded sprites, and once the newest load
+  // has completely arrived swaps it in for the live sprites. Returns true
+  // on the frame the swap happens, so objects can be updated.
+  if ( ! spriteLoadActive )
+    return false;
+
+  for (size_t n = 0; n < spriteUploadsPerFrame and !decodedSprites.empty();
+       n++)
+  {
+    Graphics::DecodedSprite& decoded = decodedSprites.front();
+
+    Graphics::Sprite* newSprite = decoded.resident;
+    if ( newSprite == NULL and decoded.decoded )
+      newSprite = new Graphics::Sprite( decoded.width, decoded.height,
+                                        decoded.hasAlpha, decoded.pixels );
+    else if ( newSprite == NULL )
+      newSprite = new Graphics::Sprite();
+
+    // Only a Sprite made from the file can be found by the file again
+    string key;
+    if ( decoded.decoded )
+      key = spriteKey( decoded.offsiteFilename, decoded.hash );
+
+    for (size_t i = 0; i < decoded.targets.size(); i++)
+      placeSprite( Graphics::pendingSprites, decoded.targets[i], 
+                   newSprite, key );
+
+    free( decoded.pixels );
+    decodedSprites.pop_front();
+  }
 
-  Errors::dbg << "Removing sprites" << endl;
-  //Iterate over groups
-  for (spriteGroupMap::iterator groupItr = sprites.begin();
-       groupItr != sprites.end();
-       groupItr++)
+  if ( spriteDownloadsPending > 0 or !decodedSprites.empty() )
+    return false;
+
+  // Everything has arrived, so the new set goes live and whatever only the
+  // old one used is deleted
+  releaseSprites( Graphics::sprites );
+  Graphics::sprites.swap( Graphics::pendingSprites );
+  liveGroupHashes = pendingGroupHashes;
+  evictSprites();
+  spriteLoadActive = false;
+
+  Errors::dbg << "Sprite load complete" << endl;
+  return true;
+}
+
+bool Graphics::spritesPending()
+{
+  return spriteLoadActive;
+}
+
+void Graphics::spriteFiles( std::vector<string>& urls )
+{
+  // The URLs of the files held Sprites were made from, each once
+  urls.clear();
+  Graphics::SpriteCacheIndex::iterator cached;
+  for ( cached  = spriteCacheIndex.begin(); 
+        cached != spriteCacheIndex.end(); cached++ )
   {
-    //Iterate over sprites in group
-    for(spriteGroup::iterator spriteItr = groupItr -> second . begin();
-        spriteItr != groupItr -> second . end();
-        spriteItr++)
-    {
-      delete spriteItr -> second;
-      spriteItr -> second = NULL; //Unnecessary but good practice
-    }
-    //Clear the group
-    groupItr -> second . clear();
+    string url = cached -> first.substr( 0, cached -> first.rfind( ' ' ) );
+    if ( urls.empty() or urls.back() != url )
+      urls.push_back( url );
   }
+}
 
-  //Clear the group map
-  sprites.clear();
+void Graphics::removeSprites()
+{
+  Errors::dbg << "Removing sprites" << endl;
+  Graphics::removeSprites( Graphics::sprites );
+}
+
+void Graphics::removeSprites( Graphics::spriteGroupMap& groups )
+{
+  // Sprites carried over are in both the live and the pending set, so
+  // only those the other set doesn't use are deleted
+  releaseSprites( groups );
+  if ( &groups == &Graphics::sprites )
+    liveGroupHashes.clear();
+  evictSprites();
 }
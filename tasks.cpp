@@ -0,0 +1,116 @@
+//Ours
+#include "tasks.h"
+#include "errors.h"
+
+//Standard
+#include <deque>
+#include <iostream>
+
+//pthreads
+#include <pthread.h>
+
+using std::endl;
+
+// Number of worker threads, started on the first post()
+const int workerCount = 2;
+
+bool            workersStarted = false;
+int             workersRunning = 0; // If none would start, process() does
+pthread_t       workers[ workerCount ]; // the work itself
+
+pthread_mutex_t queueLock     = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  queueSignal   = PTHREAD_COND_INITIALIZER;
+Tasks::TaskQueue waitingTasks;
+
+pthread_mutex_t finishedLock  = PTHREAD_MUTEX_INITIALIZER;
+Tasks::TaskQueue finishedTasks;
+
+void* workerLoop( void* )
+{
+  while ( true )
+  {
+    pthread_mutex_lock( &queueLock );
+    while ( waitingTasks.empty() )
+      pthread_cond_wait( &queueSignal, &queueLock );
+
+    Tasks::Task task = waitingTasks.front();
+    waitingTasks.pop_front();
+    pthread_mutex_unlock( &queueLock );
+
+    if ( task.work != NULL )
+      (*task.work)( task.data );
+
+    pthread_mutex_lock( &finishedLock );
+    finishedTasks.push_back( task );
+    pthread_mutex_unlock( &finishedLock );
+  }
+
+  return NULL;
+}
+
+void Tasks::post( Tasks::taskFunc work, Tasks::taskFunc finish, void* data )
+{
+  if ( ! workersStarted )
+  {
+    for ( int i = 0; i < workerCount; i++ )
+    {
+      if ( pthread_create( &workers[workersRunning], NULL, &workerLoop, 
+                           NULL ) == 0 )
+        workersRunning++;
+      else
+        Errors::err << "Unable to start worker thread " << i << endl;
+    }
+    workersStarted = true;
+
+    if ( workersRunning == 0 )
+      Errors::err << "No worker threads, tasks will run on the render "
+                  << "thread" << endl;
+  }
+
+  Tasks::Task task;
+  task.work   = work;
+  task.finish = finish;
+  task.data   = data;
+
+  pthread_mutex_lock( &queueLock );
+  waitingTasks.push_back( task );
+  pthread_cond_signal( &queueSignal );
+  pthread_mutex_unlock( &queueLock );
+}
+
+void Tasks::process()
+{
+  // Without workers the waiting tasks are done here, as they would have
+  // been before there were any
+  if ( workersRunning == 0 )
+  {
+    Tasks::TaskQueue waiting;
+    pthread_mutex_lock( &queueLock );
+    waiting.swap( waitingTasks );
+    pthread_mutex_unlock( &queueLock );
+
+    for ( size_t i = 0; i < waiting.size(); i++ )
+    {
+      if ( waiting[i].work != NULL )
+        (*waiting[i].work)( waiting[i].data );
+    }
+
+    pthread_mutex_lock( &finishedLock );
+    finishedTasks.insert( finishedTasks.end(), waiting.begin(), 
+                          waiting.end() );
+    pthread_mutex_unlock( &finishedLock );
+  }
+
+  // Take everything that has finished in one go, so the lock is not held
+  // whilst the finish functions run (they may well post more tasks).
+  Tasks::TaskQueue finished;
+  pthread_mutex_lock( &finishedLock );
+  finished.swap( finishedTasks );
+  pthread_mutex_unlock( &finishedLock );
+
+  for ( size_t i = 0; i < finished.size(); i++ )
+  {
+    if ( finished[i].finish != NULL )
+      (*finished[i].finish)( finished[i].data );
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef TASKS_H_INC
+#define TASKS_H_INC
+
+#include <deque>
+
+#include <pthread.h>
+
+// Background work that must stay off the render thread.
+//
+// post() queues a task. Its work function is run on one of the worker
+// threads, and its finish function is then run back on the render thread
+// from process(), which goes in the main loop. Work functions must not
+// touch GL or any of the global scene state. If no worker thread can be
+// started, process() runs the work functions as well.
+namespace Tasks
+{
+  typedef void (*taskFunc)( void* );
+
+  struct Task
+  {
+    taskFunc work;
+    taskFunc finish;
+    void*    data;
+  };
+
+  typedef std::deque< Task > TaskQueue;
+
+  void post( taskFunc work, taskFunc finish, void* data );
+  void process();
+};
+
+#endif //Include guard